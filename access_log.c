@@ -0,0 +1,208 @@
+#include "access_log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FLUSH_BUFFER_SIZE (1024 * 64)
+#define LOG_LINE_SIZE (LOG_PATH_SIZE + 256)
+
+// Rings live as long as the server and are added at the front of the list,
+// so the flusher can walk it without the lock
+struct access_log *logs;
+pthread_mutex_t logsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Drops already reported, only used by the flusher
+unsigned long long reportedDropped, reportedSampled;
+
+pthread_t flusher;
+int flusherStopping;
+
+/**
+ * Adds a ring for a thread
+ */
+struct access_log *access_log_acquire()
+{
+    struct access_log *log = (struct access_log*)calloc(1, sizeof(struct access_log));
+
+    pthread_mutex_lock(&logsLock);
+    log->next = logs;
+    __atomic_store_n(&logs, log, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&logsLock);
+    return log;
+}
+
+/**
+ * Returns the next free record of the ring for the response with the status
+ * code, or NULL if the record is not kept. Once the ring is three quarters
+ * full only one in ACCESS_LOG_SAMPLE_RATE successful responses is kept, to
+ * leave room for the errors; a full ring drops everything
+ */
+struct access_record *access_log_reserve(struct access_log *log, int status)
+{
+    unsigned long long used = log->head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+
+    if (used == ACCESS_LOG_RING_SIZE)
+    {
+        __atomic_store_n(&log->dropped, log->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (used >= ACCESS_LOG_RING_SIZE * 3 / 4 && status < 400
+        && log->sampleCount++ % ACCESS_LOG_SAMPLE_RATE != 0)
+    {
+        __atomic_store_n(&log->sampled, log->sampled + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &log->records[log->head & (ACCESS_LOG_RING_SIZE - 1)];
+}
+
+/**
+ * Hands the record returned by access_log_reserve over to the flusher
+ */
+void access_log_commit(struct access_log *log)
+{
+    __atomic_store_n(&log->head, log->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies src into the field of a record, cut to fit. Bytes that would break
+ * the line up, such as spaces and quotes, are replaced
+ */
+void access_log_copy(char *dst, const char *src, size_t sz)
+{
+    size_t i;
+    for (i = 0; i + 1 < sz && src[i]; i++) {
+        dst[i] = (unsigned char)src[i] <= ' ' || src[i] == '"' || src[i] == 0x7f ? '?' : src[i];
+    }
+    dst[i] = '\0';
+}
+
+/**
+ * Writes all of buf to fd. Returns -1 if the log cannot be written
+ */
+int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+    while (len > 0)
+    {
+        if ((n = write(fd, buf, len)) < 0)
+        {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+size_t format_record(char *line, const struct access_record *r)
+{
+    char date[32];
+    struct tm tm;
+
+    gmtime_r(&r->time, &tm);
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%SZ", &tm);
+    return snprintf(line, LOG_LINE_SIZE,
+                    "time=%s client=%s method=%s path=%s status=%d bytes=%lld duration_us=%lld\n",
+                    date, r->client, r->method, r->path, r->status, r->bytes, r->durationUs);
+}
+
+/**
+ * Empties every ring into fd, in batches of up to sz bytes gathered in buf,
+ * and reports the records dropped since the last flush. Records of one
+ * thread stay in order, records of different threads may not.
+ * Returns the number of bytes written
+ */
+size_t access_log_flush(char *buf, size_t sz, int fd)
+{
+    struct access_log *log;
+    unsigned long long head, tail, dropped = 0, sampled = 0;
+    size_t len = 0, written = 0;
+    time_t now;
+    struct tm tm;
+
+    for (log = __atomic_load_n(&logs, __ATOMIC_ACQUIRE); log != NULL; log = log->next)
+    {
+        head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+        for (tail = log->tail; tail != head; tail++)
+        {
+            if (len + LOG_LINE_SIZE > sz)
+            {
+                write_all(fd, buf, len);
+                written += len;
+                len = 0;
+            }
+            len += format_record(buf + len, &log->records[tail & (ACCESS_LOG_RING_SIZE - 1)]);
+        }
+        // The records can be written over once the tail moves past them
+        __atomic_store_n(&log->tail, head, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+        sampled += __atomic_load_n(&log->sampled, __ATOMIC_RELAXED);
+    }
+
+    if (dropped != reportedDropped || sampled != reportedSampled)
+    {
+        if (len + LOG_LINE_SIZE > sz)
+        {
+            write_all(fd, buf, len);
+            written += len;
+            len = 0;
+        }
+        now = time(NULL);
+        len += strftime(buf + len, sz - len, "time=%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &tm));
+        len += snprintf(buf + len, sz - len, " msg=\"access log behind\" dropped=%llu sampled=%llu\n",
+                        dropped - reportedDropped, sampled - reportedSampled);
+        reportedDropped = dropped;
+        reportedSampled = sampled;
+    }
+    if (len > 0)
+    {
+        write_all(fd, buf, len);
+        written += len;
+    }
+    return written;
+}
+
+void *run_flusher(void *arg)
+{
+    int fd = (int)(long)arg;
+    char *buf = (char*)malloc(FLUSH_BUFFER_SIZE);
+    struct timespec interval = { 0, ACCESS_LOG_FLUSH_MS * 1000000L };
+
+    while (!__atomic_load_n(&flusherStopping, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&interval, NULL);
+        access_log_flush(buf, FLUSH_BUFFER_SIZE, fd);
+    }
+    // Whatever was committed before the stop
+    access_log_flush(buf, FLUSH_BUFFER_SIZE, fd);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Starts the thread flushing the rings of every thread to fd every
+ * ACCESS_LOG_FLUSH_MS. Only that thread ever writes to fd, so a slow file
+ * or pipe fills the rings up instead of stalling the server.
+ * Returns -1 if the thread could not be started
+ */
+int access_log_start(int fd)
+{
+    return pthread_create(&flusher, NULL, run_flusher, (void*)(long)fd) != 0 ? -1 : 0;
+}
+
+/**
+ * Flushes the records committed so far one last time and stops the thread
+ * started by access_log_start
+ */
+void access_log_stop()
+{
+    __atomic_store_n(&flusherStopping, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+}
@@ -0,0 +1,50 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <time.h>
+#include <arpa/inet.h>
+
+#define ACCESS_LOG_RING_SIZE 4096       // Records per thread, a power of two
+#define ACCESS_LOG_FLUSH_MS 50
+#define ACCESS_LOG_SAMPLE_RATE 8        // 1 in how many successes are kept when a ring is filling up
+#define LOG_METHOD_SIZE 16
+#define LOG_PATH_SIZE 256
+
+/**
+ * One answered request
+ */
+struct access_record {
+    time_t time;
+    char client[INET6_ADDRSTRLEN];
+    char method[LOG_METHOD_SIZE];
+    char path[LOG_PATH_SIZE];
+    int status;
+    long long bytes;
+    long long durationUs;
+};
+
+/**
+ * Ring of records written by one thread and emptied by the flusher thread.
+ * Each index is only moved by its own side, so neither side takes a lock or
+ * waits for the other: a full ring drops the record instead
+ */
+struct access_log {
+    struct access_record records[ACCESS_LOG_RING_SIZE];
+    unsigned long long head __attribute__((aligned(64)));   // Next record to write
+    unsigned long long dropped;
+    unsigned long long sampled;         // Skipped to keep room for errors
+    unsigned long long sampleCount;
+    unsigned long long tail __attribute__((aligned(64)));   // Next record to flush
+
+    struct access_log *next;
+};
+
+int access_log_start(int fd);
+void access_log_stop();
+struct access_log *access_log_acquire();
+struct access_record *access_log_reserve(struct access_log *log, int status);
+void access_log_commit(struct access_log *log);
+void access_log_copy(char *dst, const char *src, size_t sz);
+size_t access_log_flush(char *buf, size_t sz, int fd);
+
+#endif
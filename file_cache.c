@@ -0,0 +1,584 @@
+#define _GNU_SOURCE
+
+#include "file_cache.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define NUM_SHARDS 16
+#define NUM_BUCKETS 1024                // Per shard
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * Part of the cache holding the paths that hash to it. Entries are found
+ * through the hash table and evicted from the tail of the LRU list, both
+ * guarded by the lock of the shard, so threads asking for files of different
+ * shards never wait for each other. Each shard gets an equal share of the
+ * limits of the cache
+ */
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *buckets[NUM_BUCKETS];
+    struct cache_entry *lruHead, *lruTail;
+    size_t bytes;                       // Held in memory
+    int fds;                            // Kept open
+} __attribute__((aligned(64)));
+
+struct cache_shard cacheShards[NUM_SHARDS];
+size_t cacheMaxBytes, cacheMaxFileBytes;
+int cacheMaxFds;
+
+// Media types by extension, sorted for bsearch. Text types compress well
+// and get a gzip variant
+const struct mime_type mimeTypes[] = {
+    { "avif",  "image/avif",                0 },
+    { "css",   "text/css",                  1 },
+    { "csv",   "text/csv",                  1 },
+    { "gif",   "image/gif",                 0 },
+    { "gz",    "application/gzip",          0 },
+    { "htm",   "text/html",                 1 },
+    { "html",  "text/html",                 1 },
+    { "ico",   "image/x-icon",              0 },
+    { "jpeg",  "image/jpeg",                0 },
+    { "jpg",   "image/jpeg",                0 },
+    { "js",    "text/javascript",           1 },
+    { "json",  "application/json",          1 },
+    { "md",    "text/markdown",             1 },
+    { "mjs",   "text/javascript",           1 },
+    { "mp3",   "audio/mpeg",                0 },
+    { "mp4",   "video/mp4",                 0 },
+    { "pdf",   "application/pdf",           0 },
+    { "png",   "image/png",                 0 },
+    { "svg",   "image/svg+xml",             1 },
+    { "txt",   "text/plain",                1 },
+    { "wasm",  "application/wasm",          0 },
+    { "webm",  "video/webm",                0 },
+    { "webp",  "image/webp",                0 },
+    { "woff",  "font/woff",                 0 },
+    { "woff2", "font/woff2",                0 },
+    { "xml",   "application/xml",           1 },
+    { "zip",   "application/zip",           0 },
+};
+const struct mime_type defaultMimeType = { "", "application/octet-stream", 0 };
+
+// Without inotify, entries are checked against the mtime of the file on every hit
+int inotifyFd = -1;
+
+unsigned int hash_path(const char *path)
+{
+    unsigned int h = 2166136261u;
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h;
+}
+
+struct cache_shard *shard_of(unsigned int hash)
+{
+    return &cacheShards[hash % NUM_SHARDS];
+}
+
+struct cache_entry **bucket_of(struct cache_shard *shard, unsigned int hash)
+{
+    return &shard->buckets[hash / NUM_SHARDS % NUM_BUCKETS];
+}
+
+void free_entry(struct cache_entry *entry)
+{
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry->path);
+    free(entry->head);
+    free(entry->data);
+    free(entry->gzipHead);
+    free(entry->gzipData);
+    free(entry);
+}
+
+/**
+ * Returns how much memory the entry takes from the limit of its shard
+ */
+size_t entry_bytes(const struct cache_entry *entry)
+{
+    return entry->data != NULL ? entry->length + entry->gzipLength : 0;
+}
+
+/**
+ * Takes the entry out of the hash table and the LRU list of its shard and
+ * drops the reference of the cache. Must be called with the lock held
+ */
+void remove_entry(struct cache_shard *shard, struct cache_entry *entry)
+{
+    struct cache_entry **pp = bucket_of(shard, entry->hash);
+    while (*pp != entry) {
+        pp = &(*pp)->hashNext;
+    }
+    *pp = entry->hashNext;
+
+    if (entry->lruPrev) entry->lruPrev->lruNext = entry->lruNext;
+    else shard->lruHead = entry->lruNext;
+    if (entry->lruNext) entry->lruNext->lruPrev = entry->lruPrev;
+    else shard->lruTail = entry->lruPrev;
+
+    shard->bytes -= entry_bytes(entry);
+    shard->fds -= entry->fd >= 0;
+    if (--entry->refs == 0) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * Removes every entry of the shard for the file behind the inotify watch.
+ * Must be called with the lock held
+ */
+void invalidate_watch(struct cache_shard *shard, int wd)
+{
+    struct cache_entry *entry = shard->lruHead, *next;
+    while (entry != NULL) {
+        next = entry->lruNext;
+        if (entry->wd == wd) {
+            remove_entry(shard, entry);
+        }
+        entry = next;
+    }
+}
+
+void* watch_files(void *argument)
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    ssize_t len;
+    char *ptr;
+    int i;
+
+    while ((len = read(inotifyFd, buffer, sizeof buffer)) != 0)
+    {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("inotify");
+            break;
+        }
+        // A file can be cached under several paths, in any shard
+        for (i = 0; i < NUM_SHARDS; i++)
+        {
+            pthread_mutex_lock(&cacheShards[i].lock);
+            for (ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len)
+            {
+                event = (struct inotify_event*)ptr;
+                invalidate_watch(&cacheShards[i], event->wd);
+            }
+            pthread_mutex_unlock(&cacheShards[i].lock);
+        }
+        // An entry added meanwhile may share a watch removed here. Removing it
+        // sends IN_IGNORED, which invalidates that entry too
+        for (ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len)
+        {
+            event = (struct inotify_event*)ptr;
+            if (!(event->mask & IN_IGNORED)) {
+                inotify_rm_watch(inotifyFd, event->wd);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Sets the limits of the cache, on memory, on the size of the files held in
+ * memory and on the larger files kept open, and starts the thread
+ * invalidating entries of modified files
+ */
+int file_cache_init(size_t maxBytes, size_t maxFileBytes, int maxFds)
+{
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_init(&cacheShards[i].lock, NULL);
+    }
+    cacheMaxBytes = maxBytes / NUM_SHARDS;
+    cacheMaxFileBytes = min(maxFileBytes, cacheMaxBytes);
+    cacheMaxFds = max(maxFds / NUM_SHARDS, 1);
+    if ((inotifyFd = inotify_init1(IN_CLOEXEC)) < 0) {
+        perror("inotify_init1");
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, watch_files, NULL) != 0) {
+        close(inotifyFd);
+        inotifyFd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Finds the entry of the path in its shard and moves it to the front of the
+ * LRU list. Must be called with the lock held
+ */
+struct cache_entry *lookup_entry(struct cache_shard *shard, const char *path, unsigned int hash)
+{
+    struct cache_entry *entry;
+    struct stat st;
+
+    for (entry = *bucket_of(shard, hash); entry != NULL; entry = entry->hashNext) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) break;
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->wd < 0 && (stat(path, &st) < 0 
+                          || st.st_mtim.tv_sec != entry->mtime.tv_sec 
+                          || st.st_mtim.tv_nsec != entry->mtime.tv_nsec
+                          || (size_t)st.st_size != entry->length))
+    {
+        remove_entry(shard, entry);
+        return NULL;
+    }
+
+    if (entry != shard->lruHead) {
+        entry->lruPrev->lruNext = entry->lruNext;
+        if (entry->lruNext) entry->lruNext->lruPrev = entry->lruPrev;
+        else shard->lruTail = entry->lruPrev;
+        entry->lruPrev = NULL;
+        entry->lruNext = shard->lruHead;
+        shard->lruHead->lruPrev = entry;
+        shard->lruHead = entry;
+    }
+    return entry;
+}
+
+void make_validators(const struct stat *st, struct file_validators *v)
+{
+    snprintf(v->etag, ETAG_SIZE, "\"%llx-%llx\"", (long long)st->st_size,
+             (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec);
+    format_http_date(st->st_mtim.tv_sec, v->lastModified, HTTP_DATE_SIZE);
+    v->mtime = st->st_mtim.tv_sec;
+}
+
+int compare_extension(const void *key, const void *type)
+{
+    return strcasecmp((const char*)key, ((const struct mime_type*)type)->extension);
+}
+
+/**
+ * Returns the media type of the file, going by its extension, or
+ * application/octet-stream if it is unknown
+ */
+const struct mime_type *file_mime_type(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    const struct mime_type *type;
+
+    if (ext == NULL || strchr(ext, '/') != NULL) {
+        return &defaultMimeType;
+    }
+    type = (const struct mime_type*)bsearch(ext + 1, mimeTypes, sizeof mimeTypes / sizeof mimeTypes[0],
+                                            sizeof mimeTypes[0], compare_extension);
+    return type != NULL ? type : &defaultMimeType;
+}
+
+/**
+ * Returns whether the file is of a text type that compresses well, going by
+ * its extension. Only these get a gzip variant
+ */
+int file_compressible(const char *path)
+{
+    return file_mime_type(path)->compressible;
+}
+
+/**
+ * Compresses the data of the entry with gzip and builds the header of the
+ * variant. The variant is kept only if it is smaller
+ */
+void compress_entry(struct cache_entry *entry)
+{
+    z_stream zs;
+    size_t bound;
+
+    memset(&zs, 0, sizeof zs);
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+    bound = deflateBound(&zs, entry->length);
+    entry->gzipData = (char*)malloc(bound);
+    zs.next_in = (Bytef*)entry->data;
+    zs.avail_in = entry->length;
+    zs.next_out = (Bytef*)entry->gzipData;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= entry->length)
+    {
+        deflateEnd(&zs);
+        free(entry->gzipData);
+        entry->gzipData = NULL;
+        return;
+    }
+    entry->gzipLength = zs.total_out;
+    deflateEnd(&zs);
+
+    // Same tag as the file, with a suffix inside the quotes
+    snprintf(entry->gzipEtag, ETAG_SIZE, "%.*s-gz\"", 
+             (int)strlen(entry->validators.etag) - 1, entry->validators.etag);
+    entry->gzipHead = (char*)malloc(HEADER_SIZE);
+    entry->gzipHeadLength = snprintf(entry->gzipHead, HEADER_SIZE,
+                                     "HTTP/1.1 200 OK\r\n"
+                                     "Accept-Ranges: bytes\r\n"
+                                     "Vary: Accept-Encoding\r\n"
+                                     "Content-Type: %s\r\n"
+                                     "Content-Encoding: gzip\r\n"
+                                     "ETag: %s\r\n"
+                                     "Last-Modified: %s\r\n"
+                                     "Content-Length: %zu\r\n",
+                                     entry->mimeType->name, entry->gzipEtag,
+                                     entry->validators.lastModified, entry->gzipLength);
+}
+
+/**
+ * Reads the whole file into the entry. Returns -1 if the file changed while
+ * it was read
+ */
+int read_file(struct cache_entry *entry, int fd, const struct stat *st)
+{
+    struct stat after;
+    size_t total = 0;
+    ssize_t n;
+
+    entry->data = (char*)malloc(max(st->st_size, 1));
+    while (total < (size_t)st->st_size && (n = pread(fd, entry->data + total, st->st_size - total, total)) > 0) {
+        total += n;
+    }
+    if (total != (size_t)st->st_size || fstat(fd, &after) < 0
+        || after.st_mtim.tv_sec != st->st_mtim.tv_sec 
+        || after.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+    {
+        free(entry->data);
+        entry->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Creates the entry of the file open in fd with its prebuilt header, reading
+ * the file into memory if it is small enough. Otherwise, or if the file
+ * changed while it was read, the entry keeps fd to send the file from
+ */
+struct cache_entry *load_entry(const char *path, unsigned int hash, int fd, struct stat *st)
+{
+    struct cache_entry *entry = (struct cache_entry*)calloc(1, sizeof(struct cache_entry));
+
+    entry->path = strdup(path);
+    entry->hash = hash;
+    entry->fd = -1;
+    entry->wd = -1;
+    if ((size_t)st->st_size > cacheMaxFileBytes || read_file(entry, fd, st) < 0)
+    {
+        entry->fd = fd;
+        fstat(fd, st);
+    }
+    entry->length = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->mimeType = file_mime_type(path);
+    make_validators(st, &entry->validators);
+
+    entry->head = (char*)malloc(HEADER_SIZE);
+    entry->headLength = snprintf(entry->head, HEADER_SIZE,
+                                 "HTTP/1.1 200 OK\r\n"
+                                 "Accept-Ranges: bytes\r\n"
+                                 "%s"
+                                 "Content-Type: %s\r\n"
+                                 "ETag: %s\r\n"
+                                 "Last-Modified: %s\r\n"
+                                 "Content-Length: %zu\r\n",
+                                 entry->mimeType->compressible ? "Vary: Accept-Encoding\r\n" : "",
+                                 entry->mimeType->name, entry->validators.etag,
+                                 entry->validators.lastModified, entry->length);
+    if (entry->data != NULL && entry->mimeType->compressible) {
+        compress_entry(entry);
+    }
+    return entry;
+}
+
+/**
+ * Removes the least recently used entry of the shard holding data in memory,
+ * or the least recently used one kept open if fd is set, and its inotify watch unless another path
+ * of the same file in the shard still uses it. Paths of the same file in other
+ * shards lose the watch with it, and are invalidated by the IN_IGNORED event
+ * that follows. Must be called with the lock held
+ */
+void evict_entry(struct cache_shard *shard, int fd)
+{
+    struct cache_entry *entry = shard->lruTail, *other;
+    int wd;
+
+    while (fd ? entry->fd < 0 : entry_bytes(entry) == 0) {
+        entry = entry->lruPrev;
+    }
+    wd = entry->wd;
+    remove_entry(shard, entry);
+    if (wd < 0) {
+        return;
+    }
+    for (other = shard->lruHead; other != NULL; other = other->lruNext) {
+        if (other->wd == wd) return;
+    }
+    inotify_rm_watch(inotifyFd, wd);
+}
+
+/**
+ * Makes room for the entry in its shard by evicting the least recently used
+ * ones and adds it. Must be called with the lock held
+ */
+void insert_entry(struct cache_shard *shard, struct cache_entry *entry)
+{
+    struct cache_entry **bucket = bucket_of(shard, entry->hash);
+
+    // Entries only kept open take no memory, so they are not evicted for it
+    while (shard->bytes > 0 && shard->bytes + entry_bytes(entry) > cacheMaxBytes) {
+        evict_entry(shard, 0);
+    }
+    if (entry->fd >= 0 && shard->fds == cacheMaxFds) {
+        evict_entry(shard, 1);
+    }
+    if (inotifyFd >= 0) {
+        entry->wd = inotify_add_watch(inotifyFd, entry->path, WATCH_MASK);
+    }
+
+    entry->refs = 1;
+    entry->hashNext = *bucket;
+    *bucket = entry;
+    entry->lruNext = shard->lruHead;
+    if (shard->lruHead) shard->lruHead->lruPrev = entry;
+    shard->lruHead = entry;
+    if (shard->lruTail == NULL) shard->lruTail = entry;
+    shard->bytes += entry_bytes(entry);
+    shard->fds += entry->fd >= 0;
+}
+
+/**
+ * Returns the cached entry of the regular file at path, loading it first if
+ * it is not cached yet, or NULL if there is no such file. The caller owns a
+ * reference to the entry until it releases it, which keeps its data and fd
+ * valid even if the entry is evicted meanwhile
+ */
+struct cache_entry *file_cache_get(const char *path)
+{
+    unsigned int hash = hash_path(path);
+    struct cache_shard *shard = shard_of(hash);
+    struct cache_entry *entry, *loaded;
+    struct stat st;
+    int fd;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((entry = lookup_entry(shard, path, hash)) != NULL) {
+        entry->refs++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    loaded = load_entry(path, hash, fd, &st);
+    if (loaded->fd < 0) {
+        close(fd);
+    }
+
+    // Another thread may have loaded the same file in the meantime
+    pthread_mutex_lock(&shard->lock);
+    if ((entry = lookup_entry(shard, path, hash)) == NULL) {
+        insert_entry(shard, loaded);
+        entry = loaded;
+    }
+    else {
+        free_entry(loaded);
+    }
+    entry->refs++;
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void file_cache_release(struct cache_entry *entry)
+{
+    struct cache_shard *shard = shard_of(entry->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (--entry->refs == 0) {
+        free_entry(entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Drops every entry, so the files are read again from the document root on
+ * their next request. Entries still being sent are freed once released
+ */
+void file_cache_flush()
+{
+    int i;
+
+    for (i = 0; i < NUM_SHARDS; i++)
+    {
+        pthread_mutex_lock(&cacheShards[i].lock);
+        while (cacheShards[i].lruHead != NULL) {
+            remove_entry(&cacheShards[i], cacheShards[i].lruHead);
+        }
+        pthread_mutex_unlock(&cacheShards[i].lock);
+    }
+}
+
+size_t preloadedBytes, preloadedFiles;
+
+int preload_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    struct cache_entry *entry;
+
+    // Hidden files and directories are left out
+    if (ftw->level > 0 && path[ftw->base] == '.') {
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    }
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return FTW_CONTINUE;
+    }
+    // Entries are found by their path from the document root
+    if (strncmp(path, "./", 2) == 0) {
+        path += 2;
+    }
+    if ((entry = file_cache_get(path)) != NULL)
+    {
+        preloadedBytes += entry_bytes(entry);
+        preloadedFiles++;
+        file_cache_release(entry);
+    }
+    return preloadedBytes < cacheMaxBytes * NUM_SHARDS ? FTW_CONTINUE : FTW_STOP;
+}
+
+/**
+ * Loads the files under dir, a path from the document root, until the cache
+ * is full. Returns how many files were loaded
+ */
+size_t file_cache_preload(const char *dir)
+{
+    preloadedBytes = preloadedFiles = 0;
+    nftw(dir, preload_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+    return preloadedFiles;
+}
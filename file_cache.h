@@ -0,0 +1,72 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "utils.h"
+
+#define CACHE_SIZE (64 * 1024 * 1024)
+#define CACHED_FILE_SIZE (1024 * 1024)
+#define CACHED_FDS 1024                 // Files too large to cache kept open, at most
+#define ETAG_SIZE 64
+
+/**
+ * Validators of a version of a file, sent with it and compared with the ones
+ * of conditional requests
+ */
+struct file_validators {
+    char etag[ETAG_SIZE];                   // Quoted, from the size and mtime
+    char lastModified[HTTP_DATE_SIZE];
+    time_t mtime;
+};
+
+/**
+ * Media type sent as the Content-Type of the files with the extension
+ */
+struct mime_type {
+    const char *extension;                  // Without the dot, lowercase
+    const char *name;
+    int compressible;                       // Text that is worth sending gzipped
+};
+
+/**
+ * Cached version of a file, found by its normalized path. Files up to the
+ * size limit are held in memory; larger ones are kept open and sent from fd
+ */
+struct cache_entry {
+    char *path;
+    unsigned int hash;
+    char *head;             // Prebuilt status line and header, without the final CRLF
+    int headLength;
+    char *data;             // NULL if the file is sent from fd
+    int fd;                 // -1 if the file is held in data
+    size_t length;
+    const struct mime_type *mimeType;
+    struct timespec mtime;
+    struct file_validators validators;
+
+    // Gzip variant of a compressible file, compressed once when the file is
+    // loaded. NULL if it would not be smaller
+    char *gzipHead;
+    int gzipHeadLength;
+    char *gzipData;
+    size_t gzipLength;
+    char gzipEtag[ETAG_SIZE];
+
+    int wd;                 // inotify watch on the file, -1 if none
+    int refs;               // One held by the cache while the entry is in it, one per user
+    struct cache_entry *hashNext;
+    struct cache_entry *lruPrev, *lruNext;
+};
+
+int file_cache_init(size_t maxBytes, size_t maxFileBytes, int maxFds);
+const struct mime_type *file_mime_type(const char *path);
+int file_compressible(const char *path);
+struct cache_entry *file_cache_get(const char *path);
+void file_cache_release(struct cache_entry *entry);
+size_t file_cache_preload(const char *dir);
+void file_cache_flush();
+
+#endif
@@ -0,0 +1,143 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Fills in the address of the Unix socket at path.
+ * Returns -1 if the path is too long
+ */
+int handoff_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr->sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Listens on a Unix socket at path for the next process to ask for the
+ * listening sockets. A socket left there by the previous process is replaced.
+ * Returns the socket, or -1 on error
+ */
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int sockfd;
+
+    if (handoff_address(path, &addr) < 0 || (sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(sockfd, 1) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Connects to the process listening at path.
+ * Returns the socket, or -1 if no process is listening there
+ */
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sockfd;
+
+    if (handoff_address(path, &addr) < 0 || (sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof addr) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Sends the descriptors over the connected Unix socket, along with a single
+ * byte since a message cannot be empty. Returns -1 on error
+ */
+int handoff_send(int sockfd, const int *fds, int count)
+{
+    char byte = 'L';
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+
+    if (count <= 0 || count > MAX_LISTENERS) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    return sendmsg(sockfd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/**
+ * Receives up to max descriptors sent with handoff_send. They are new
+ * descriptors of this process for the same sockets.
+ * Returns how many were received, or -1 on error
+ */
+int handoff_receive(int sockfd, int *fds, int max)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    int count = 0, i, received, fd;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    if (recvmsg(sockfd, &msg, 0) != 1) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < received; i++)
+        {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            // Descriptors there is no room for are not leaked
+            if (count < max) {
+                fds[count++] = fd;
+            }
+            else {
+                close(fd);
+            }
+        }
+    }
+    return count;
+}
@@ -0,0 +1,11 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#define MAX_LISTENERS 64                // Listening sockets passed in one handoff
+
+int handoff_listen(const char *path);
+int handoff_connect(const char *path);
+int handoff_send(int sockfd, const int *fds, int count);
+int handoff_receive(int sockfd, int *fds, int max);
+
+#endif
@@ -0,0 +1,486 @@
+#include "http_batch.h"
+#include "http_fetch.h"
+#include "http_parser.h"
+#include "utils.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS 256
+#define RECV_SIZE (1024 * 64)
+#define REQUEST_SIZE (1024 * 4)
+#define BATCH_TIMEOUT_MS 30000
+
+// States of a batch connection
+#define F_CONNECTING 0
+#define F_SENDING 1
+#define F_RECEIVING 2
+
+struct batch_job {
+    int index;              // Line of the URL in the file
+    char *url;
+    char *path;
+    struct batch_host *host;
+    char *outputPath;
+    struct file_sink output;
+    struct batch_job *next;
+};
+
+/**
+ * Origin some of the URLs point to, with the jobs waiting for one of its
+ * slots and its connections that are open and idle
+ */
+struct batch_host {
+    char *host;
+    char *port;
+    struct addrinfo *addr;  // NULL if the lookup failed
+    int inFlight;
+    int idle[MAX_IDLE_PER_HOST];
+    int numIdle;
+    struct batch_job *head;
+    struct batch_job *tail;
+    struct batch_host *next;
+};
+
+struct batch_conn {
+    int sockfd;
+    int state;
+    int reused;
+    long long lastActive;
+    char request[REQUEST_SIZE];
+    int requestLength;
+    int requestSent;
+    struct batch_job *job;
+    struct http_response res;
+    struct batch_conn *prev;
+    struct batch_conn *next;
+};
+
+struct batch {
+    const struct batch_config *config;
+    int epfd;
+    struct batch_host *hosts;
+    struct batch_conn *active;
+    struct arena strings;   // URLs and output paths of the jobs
+    int inFlight;
+    int fetched;
+    long long connects;
+    long long reuses;
+};
+
+/**
+ * Returns the origin, resolving its addresses the first time it is used
+ */
+struct batch_host *get_batch_host(struct batch *b, const char *host, const char *port)
+{
+    struct batch_host *h;
+    struct addrinfo hints;
+    int ecode;
+
+    for (h = b->hosts; h != NULL; h = h->next) {
+        if (strcmp(h->host, host) == 0 && strcmp(h->port, port) == 0) {
+            return h;
+        }
+    }
+
+    h = (struct batch_host*)calloc(1, sizeof(struct batch_host));
+    h->host = strdup(host);
+    h->port = strdup(port);
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if ((ecode = getaddrinfo(host, port, &hints, &h->addr)) != 0)
+    {
+        eprintf("getaddrinfo: %s: %s\n", host, gai_strerror(ecode));
+        h->addr = NULL;
+    }
+    h->next = b->hosts;
+    b->hosts = h;
+    return h;
+}
+
+void enqueue_job(struct batch_host *h, struct batch_job *job, int front)
+{
+    if (h->head == NULL) {
+        job->next = NULL;
+        h->head = h->tail = job;
+    }
+    else if (front) {
+        job->next = h->head;
+        h->head = job;
+    }
+    else {
+        job->next = NULL;
+        h->tail->next = job;
+        h->tail = job;
+    }
+}
+
+/**
+ * Reads the URLs from the file, skipping empty lines and lines starting with
+ * '#', and queues a job for each of them on its origin.
+ * Returns the jobs in the order of the file, or NULL if the file cannot be read
+ */
+struct batch_job *load_jobs(struct batch *b, int *numJobs)
+{
+    FILE *fp;
+    char line[REQUEST_LINE_SIZE];
+    char port[16];
+    char *url, *end, *host;
+    struct batch_job *jobs = NULL;
+    int size = 0, index = 0;
+
+    if ((fp = fopen(b->config->urlFile, "r")) == NULL)
+    {
+        perror("client: fopen");
+        return NULL;
+    }
+    *numJobs = 0;
+    while (fgets(line, sizeof line, fp) != NULL)
+    {
+        index++;
+        for (url = line; *url == ' ' || *url == '\t'; url++);
+        for (end = url + strlen(url); end > url && isspace((unsigned char)end[-1]); end--);
+        *end = '\0';
+        if (*url == '\0' || *url == '#') {
+            continue;
+        }
+
+        if (*numJobs == size) {
+            size = size ? 2 * size : 64;
+            jobs = (struct batch_job*)realloc(jobs, size * sizeof(struct batch_job));
+        }
+        memset(&jobs[*numJobs], 0, sizeof(struct batch_job));
+        jobs[*numJobs].index = index;
+        jobs[*numJobs].url = arena_strdup(&b->strings, url);
+        parse_uri(url, &host, &jobs[*numJobs].path);
+        split_host_port(host, b->config->defaultPort, port, sizeof port);
+        jobs[*numJobs].host = get_batch_host(b, host, port);
+        free(host);
+        (*numJobs)++;
+    }
+    fclose(fp);
+
+    // Queued once the array stops moving
+    for (index = 0; index < *numJobs; index++)
+    {
+        jobs[index].outputPath = (char*)arena_alloc(&b->strings, strlen(b->config->outputDir) + 16);
+        sprintf(jobs[index].outputPath, "%s/body_%d", b->config->outputDir, jobs[index].index);
+        jobs[index].output.path = jobs[index].outputPath;
+        jobs[index].output.fd = -1;
+        enqueue_job(jobs[index].host, &jobs[index], 0);
+    }
+    return jobs != NULL ? jobs : (struct batch_job*)calloc(1, sizeof(struct batch_job));
+}
+
+void report_job(struct batch *b, struct batch_job *job, struct http_response *res, int ok)
+{
+    if (!ok)
+    {
+        eprintf("client: failed to fetch %s\n", job->url);
+        return;
+    }
+    if (job->output.bytes == 0) {
+        printf("%d %s (empty body)\n", res->statusCode, job->url);
+    }
+    else {
+        printf("%d %s -> %s (%lld bytes)\n", res->statusCode, job->url,
+               job->outputPath, job->output.bytes);
+    }
+    b->fetched++;
+}
+
+/**
+ * Sends the request of the job on an idle connection to its origin, or
+ * starts a non-blocking connect for a new one.
+ * Returns -1 if no connection could be set up
+ */
+int start_job(struct batch *b, struct batch_job *job)
+{
+    struct batch_host *h = job->host;
+    struct batch_conn *conn;
+    struct epoll_event ev;
+    int yes = 1;
+
+    if (h->addr == NULL) {
+        return -1;
+    }
+    conn = (struct batch_conn*)calloc(1, sizeof(struct batch_conn));
+    conn->job = job;
+    conn->lastActive = now_ms();
+    conn->requestLength = snprintf(conn->request, REQUEST_SIZE, 
+                                   "GET %s HTTP/1.1\r\nHost: %s\r\n" ACCEPT_ENCODING "\r\n",
+                                   job->path, h->host);
+    http_response_init(&conn->res);
+
+    if (h->numIdle > 0)
+    {
+        conn->sockfd = h->idle[--h->numIdle];
+        conn->reused = 1;
+        conn->state = F_SENDING;
+        b->reuses++;
+    }
+    else
+    {
+        if ((conn->sockfd = socket(h->addr->ai_family, h->addr->ai_socktype | SOCK_NONBLOCK,
+                                   h->addr->ai_protocol)) < 0) {
+            free(conn);
+            return -1;
+        }
+        setsockopt(conn->sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+        if (connect(conn->sockfd, h->addr->ai_addr, h->addr->ai_addrlen) < 0 && errno != EINPROGRESS)
+        {
+            close(conn->sockfd);
+            free(conn);
+            return -1;
+        }
+        conn->state = F_CONNECTING;
+        b->connects++;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, conn->sockfd, &ev) < 0)
+    {
+        close(conn->sockfd);
+        free(conn);
+        return -1;
+    }
+    conn->next = b->active;
+    if (b->active != NULL) {
+        b->active->prev = conn;
+    }
+    b->active = conn;
+    h->inFlight++;
+    b->inFlight++;
+    return 0;
+}
+
+/**
+ * Starts the queued jobs of every origin until either the origin or the
+ * whole batch has as many requests in flight as allowed
+ */
+void start_jobs(struct batch *b)
+{
+    struct batch_host *h;
+    struct batch_job *job;
+
+    for (h = b->hosts; h != NULL && b->inFlight < b->config->maxInFlight; h = h->next)
+    {
+        while (h->head != NULL && h->inFlight < b->config->maxPerHost
+               && b->inFlight < b->config->maxInFlight)
+        {
+            job = h->head;
+            if ((h->head = job->next) == NULL) {
+                h->tail = NULL;
+            }
+            if (start_job(b, job) < 0) {
+                report_job(b, job, NULL, 0);
+            }
+        }
+    }
+}
+
+/**
+ * Advances the connection as far as its socket allows.
+ * Returns 1 once the response is complete, -1 if the connection failed and
+ * 0 otherwise
+ */
+int batch_drive(struct batch_conn *conn, char *buffer)
+{
+    int err = 0;
+    socklen_t errLen = sizeof err;
+    ssize_t n;
+    long consumed, offset;
+
+    if (conn->state == F_CONNECTING)
+    {
+        if (getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0) {
+            return -1;
+        }
+        conn->state = F_SENDING;
+    }
+    while (conn->state == F_SENDING)
+    {
+        n = send(conn->sockfd, conn->request + conn->requestSent,
+                 conn->requestLength - conn->requestSent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        conn->lastActive = now_ms();
+        if ((conn->requestSent += n) == conn->requestLength) {
+            conn->state = F_RECEIVING;
+        }
+    }
+    while (conn->state == F_RECEIVING)
+    {
+        if ((n = recv(conn->sockfd, buffer, RECV_SIZE, 0)) < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        conn->lastActive = now_ms();
+        if (n == 0)
+        {
+            if (!conn->res.headDone || body_decoder_eof(&conn->res.body) < 0) {
+                return -1;
+            }
+            conn->res.keepAlive = 0;
+        }
+        for (offset = 0; offset < n && !conn->res.body.done; offset += consumed) {
+            if ((consumed = parse_http_response(&conn->res, buffer + offset, n - offset,
+                                                write_to_file, &conn->job->output)) < 0) {
+                return -1;
+            }
+        }
+        if (conn->res.body.done) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Takes the connection out of the batch once its job is over, keeping it for
+ * the next job to the same origin if the server allows. A request that failed
+ * on a reused connection before any of the response arrived is queued again,
+ * since the server may have closed the connection while it was idle
+ */
+void finish_job(struct batch *b, struct batch_conn *conn, int rv)
+{
+    struct batch_job *job = conn->job;
+    struct batch_host *h = job->host;
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else b->active = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    h->inFlight--;
+    b->inFlight--;
+
+    if (rv > 0 && conn->res.keepAlive && h->numIdle < MAX_IDLE_PER_HOST) {
+        epoll_ctl(b->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+        h->idle[h->numIdle++] = conn->sockfd;
+    }
+    else {
+        close(conn->sockfd);
+    }
+    if (job->output.fd >= 0) {
+        close(job->output.fd);
+        job->output.fd = -1;
+    }
+
+    if (rv < 0 && conn->reused && conn->res.headLength == 0) {
+        enqueue_job(h, job, 1);
+    }
+    else {
+        report_job(b, job, &conn->res, rv > 0);
+    }
+    http_response_free(&conn->res);
+    free(conn);
+}
+
+/**
+ * Fails the requests that have seen no activity for longer than the timeout
+ */
+void expire_requests(struct batch *b)
+{
+    struct batch_conn *conn, *next;
+    long long now = now_ms();
+
+    for (conn = b->active; conn != NULL; conn = next)
+    {
+        next = conn->next;
+        if (now - conn->lastActive >= BATCH_TIMEOUT_MS) {
+            eprintf("client: %s timed out\n", conn->job->url);
+            conn->reused = 0;
+            finish_job(b, conn, -1);
+        }
+    }
+}
+
+/**
+ * Fetches every URL of the file from one thread with non-blocking sockets,
+ * keeping up to maxInFlight requests in flight and no more than maxPerHost
+ * of them to the same origin. Connections are reused for the following URLs
+ * of the same origin. Each body is saved to body_<line> in the output
+ * directory, where line is the line of its URL in the file.
+ * Returns the number of URLs that could not be fetched, or -1 on error
+ */
+int run_batch(const struct batch_config *config)
+{
+    struct batch b;
+    struct batch_job *jobs;
+    struct batch_host *h, *next;
+    struct epoll_event events[MAX_EVENTS];
+    struct batch_conn *conn;
+    char *buffer;
+    long long start = now_us();
+    int numJobs, i, n, rv;
+
+    memset(&b, 0, sizeof b);
+    b.config = config;
+    arena_init(&b.strings, 1024 * 16);
+    if ((jobs = load_jobs(&b, &numJobs)) == NULL) {
+        arena_free(&b.strings);
+        return -1;
+    }
+    if ((b.epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    buffer = (char*)malloc(RECV_SIZE);
+
+    start_jobs(&b);
+    while (b.inFlight > 0)
+    {
+        if ((n = epoll_wait(b.epfd, events, MAX_EVENTS, 1000)) < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++)
+        {
+            conn = (struct batch_conn*)events[i].data.ptr;
+            if ((rv = batch_drive(conn, buffer)) != 0) {
+                finish_job(&b, conn, rv);
+            }
+        }
+        expire_requests(&b);
+        start_jobs(&b);
+    }
+
+    printf("Fetched %d of %d URLs in %.2f s over %lld connections (%lld reused)\n",
+           b.fetched, numJobs, (now_us() - start) / 1000000.0, b.connects, b.reuses);
+
+    while (b.active != NULL) {
+        finish_job(&b, b.active, -1);
+    }
+    for (h = b.hosts; h != NULL; h = next)
+    {
+        next = h->next;
+        for (i = 0; i < h->numIdle; i++) {
+            close(h->idle[i]);
+        }
+        if (h->addr != NULL) {
+            freeaddrinfo(h->addr);
+        }
+        free(h->host);
+        free(h->port);
+        free(h);
+    }
+    for (i = 0; i < numJobs; i++) {
+        free(jobs[i].path);
+    }
+    arena_free(&b.strings);
+    free(jobs);
+    free(buffer);
+    close(b.epfd);
+    return numJobs - b.fetched;
+}
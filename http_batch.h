@@ -0,0 +1,14 @@
+#ifndef HTTP_BATCH_H
+#define HTTP_BATCH_H
+
+struct batch_config {
+    const char *urlFile;        // One URL per line
+    const char *defaultPort;    // For the URLs without a port
+    const char *outputDir;      // Gets one body file per URL
+    int maxInFlight;            // Requests in flight in total
+    int maxPerHost;             // Requests in flight to the same origin
+};
+
+int run_batch(const struct batch_config *config);
+
+#endif
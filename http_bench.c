@@ -0,0 +1,369 @@
+#include "http_bench.h"
+#include "http_parser.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS 256
+#define RECV_SIZE (1024 * 64)
+#define REQUEST_SIZE (1024 * 4)
+#define BENCH_TIMEOUT_MS 10000          // For connecting or for a response, before it counts as an error
+
+// States of a benchmark connection
+#define B_CONNECTING 0
+#define B_SENDING 1
+#define B_RECEIVING 2
+#define B_IDLE 3
+
+struct bench_conn {
+    int sockfd;
+    int state;
+    int requestSent;
+    long long connectStart;
+    long long requestStart;
+    long long firstByte;
+    struct http_response res;
+};
+
+struct bench_thread {
+    pthread_t thread;
+    int numConns;
+    struct histogram connect, ttfb, response;
+    long long completed;
+    long long errors;
+    long long bytes;
+};
+
+const struct bench_config *bench;
+struct addrinfo *benchAddr;
+char benchRequest[REQUEST_SIZE];
+int benchRequestLength;
+long long benchDeadline;
+long long requestsClaimed = 0;
+
+/**
+ * Returns whether the duration and the number of requests are not used up
+ */
+int requests_left()
+{
+    return (benchDeadline == 0 || now_us() < benchDeadline)
+        && (bench->requests == 0 || __atomic_load_n(&requestsClaimed, __ATOMIC_RELAXED) < bench->requests);
+}
+
+/**
+ * Takes the right to send one more request, shared by all threads.
+ * Returns 0 once the duration or the number of requests is used up
+ */
+int claim_request()
+{
+    if (benchDeadline > 0 && now_us() >= benchDeadline) {
+        return 0;
+    }
+    if (bench->requests > 0 && __atomic_fetch_add(&requestsClaimed, 1, __ATOMIC_RELAXED) >= bench->requests) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Body bytes are only counted
+ */
+long discard_body(void *arg, const char *data, size_t len)
+{
+    ((struct bench_thread*)arg)->bytes += len;
+    return len;
+}
+
+/**
+ * Starts a non-blocking connect for the connection and registers it.
+ * Returns -1 if the socket could not be created
+ */
+int bench_connect(int epfd, struct bench_conn *conn)
+{
+    struct epoll_event ev;
+    int yes = 1;
+
+    if ((conn->sockfd = socket(benchAddr->ai_family, benchAddr->ai_socktype | SOCK_NONBLOCK, 
+                               benchAddr->ai_protocol)) < 0) {
+        return -1;
+    }
+    setsockopt(conn->sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    conn->connectStart = now_us();
+    conn->state = B_CONNECTING;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = conn;
+    if ((connect(conn->sockfd, benchAddr->ai_addr, benchAddr->ai_addrlen) < 0 && errno != EINPROGRESS)
+        || epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sockfd, &ev) < 0)
+    {
+        close(conn->sockfd);
+        conn->sockfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends the next request on the connection if there is one to send, or
+ * leaves it idle otherwise
+ */
+void bench_next_request(struct bench_conn *conn)
+{
+    if (!claim_request()) {
+        conn->state = B_IDLE;
+        return;
+    }
+    conn->state = B_SENDING;
+    conn->requestSent = 0;
+    conn->requestStart = now_us();
+    conn->firstByte = 0;
+    http_response_init(&conn->res);
+}
+
+/**
+ * Advances the connection as far as its socket allows.
+ * Returns 1 if the server closed the connection after a response, -1 if the
+ * connection failed and 0 otherwise
+ */
+int bench_drive(struct bench_thread *t, struct bench_conn *conn, char *buffer)
+{
+    int err = 0;
+    socklen_t errLen = sizeof err;
+    ssize_t n;
+    long consumed, offset;
+
+    if (conn->state == B_CONNECTING)
+    {
+        if (getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0) {
+            return -1;
+        }
+        histogram_record(&t->connect, now_us() - conn->connectStart);
+        bench_next_request(conn);
+    }
+    while (conn->state == B_SENDING)
+    {
+        n = send(conn->sockfd, benchRequest + conn->requestSent, 
+                 benchRequestLength - conn->requestSent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if ((conn->requestSent += n) == benchRequestLength) {
+            conn->state = B_RECEIVING;
+        }
+    }
+    while (conn->state == B_RECEIVING)
+    {
+        if ((n = recv(conn->sockfd, buffer, RECV_SIZE, 0)) < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0) {
+            if (!conn->res.headDone || body_decoder_eof(&conn->res.body) < 0) {
+                return -1;
+            }
+        }
+        else if (conn->firstByte == 0) {
+            conn->firstByte = now_us();
+            histogram_record(&t->ttfb, conn->firstByte - conn->requestStart);
+        }
+        for (offset = 0; offset < n && !conn->res.body.done; offset += consumed) {
+            if ((consumed = parse_http_response(&conn->res, buffer + offset, n - offset, 
+                                                discard_body, t)) < 0) {
+                return -1;
+            }
+        }
+        if (conn->res.body.done)
+        {
+            histogram_record(&t->response, now_us() - conn->requestStart);
+            t->completed++;
+            if (!conn->res.keepAlive || n == 0) {
+                return 1;
+            }
+            bench_next_request(conn);
+            if (conn->state == B_SENDING) {
+                return bench_drive(t, conn, buffer);
+            }
+        }
+        else if (n == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Closes the connection, counting an error if failed is set, and opens a new
+ * one for the next request if there is one left. The connection is left idle
+ * otherwise
+ */
+void bench_reconnect(struct bench_thread *t, int epfd, struct bench_conn *conn, int failed)
+{
+    if (failed) {
+        t->errors++;
+    }
+    close(conn->sockfd);
+    conn->sockfd = -1;
+    if (!requests_left() || bench_connect(epfd, conn) < 0) {
+        conn->state = B_IDLE;
+    }
+}
+
+void* run_bench_thread(void *argument)
+{
+    struct bench_thread *t = (struct bench_thread*)argument;
+    struct bench_conn *conns = (struct bench_conn*)calloc(t->numConns, sizeof(struct bench_conn));
+    struct epoll_event events[MAX_EVENTS];
+    struct bench_conn *conn;
+    char *buffer = (char*)malloc(RECV_SIZE);
+    int epfd = epoll_create1(0);
+    long long now, since;
+    int i, n, rv, active = 0;
+
+    for (i = 0; i < t->numConns; i++) {
+        if (bench_connect(epfd, &conns[i]) == 0) {
+            active++;
+        }
+        else {
+            t->errors++;
+            conns[i].sockfd = -1;
+            conns[i].state = B_IDLE;
+        }
+    }
+
+    while (active > 0)
+    {
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, 100)) < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++)
+        {
+            conn = (struct bench_conn*)events[i].data.ptr;
+            if ((rv = bench_drive(t, conn, buffer)) != 0) {
+                bench_reconnect(t, epfd, conn, rv < 0);
+            }
+            if (conn->state == B_IDLE) {
+                if (conn->sockfd >= 0) {
+                    close(conn->sockfd);
+                    conn->sockfd = -1;
+                }
+                active--;
+            }
+        }
+        // A server that stops answering fails the requests it holds, instead
+        // of keeping a run that counts requests waiting forever
+        now = now_us();
+        for (i = 0; i < t->numConns; i++)
+        {
+            conn = &conns[i];
+            if (conn->sockfd < 0 || conn->state == B_IDLE) {
+                continue;
+            }
+            since = conn->state == B_CONNECTING ? conn->connectStart : conn->requestStart;
+            if (now - since > BENCH_TIMEOUT_MS * 1000LL)
+            {
+                bench_reconnect(t, epfd, conn, 1);
+                if (conn->state == B_IDLE) {
+                    active--;
+                }
+            }
+        }
+        // Requests still in flight at the deadline are abandoned
+        if (benchDeadline > 0 && now_us() >= benchDeadline + 1000000) {
+            break;
+        }
+    }
+
+    for (i = 0; i < t->numConns; i++) {
+        if (conns[i].sockfd >= 0) {
+            close(conns[i].sockfd);
+        }
+    }
+    close(epfd);
+    free(buffer);
+    free(conns);
+    return NULL;
+}
+
+void print_latency(const char *name, const struct histogram *h)
+{
+    printf("  %-12s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, 
+           h->total ? h->sum / 1000.0 / h->total : 0.0,
+           histogram_percentile(h, 0.5) / 1000.0, histogram_percentile(h, 0.9) / 1000.0, 
+           histogram_percentile(h, 0.99) / 1000.0, histogram_percentile(h, 0.999) / 1000.0, 
+           h->max / 1000.0);
+}
+
+/**
+ * Sends GET requests for the path from concurrent keep-alive connections
+ * spread over a few threads, then prints the throughput and the latency
+ * percentiles of connecting, the first byte and the full response
+ */
+int run_benchmark(const struct bench_config *config)
+{
+    struct addrinfo hints;
+    struct bench_thread *threads;
+    struct bench_thread total;
+    long long start;
+    double elapsed;
+    int i, ecode;
+
+    bench = config;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if ((ecode = getaddrinfo(config->host, config->port, &hints, &benchAddr)) != 0) {
+        eprintf("getaddrinfo: %s\n", gai_strerror(ecode));
+        return -1;
+    }
+    benchRequestLength = snprintf(benchRequest, REQUEST_SIZE, 
+                                  "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", config->path, config->host);
+
+    threads = (struct bench_thread*)calloc(config->threads, sizeof(struct bench_thread));
+    start = now_us();
+    benchDeadline = config->duration > 0 ? start + config->duration * 1000000LL : 0;
+    for (i = 0; i < config->threads; i++)
+    {
+        // Connections are spread as evenly as possible
+        threads[i].numConns = config->concurrency / config->threads 
+                              + (i < config->concurrency % config->threads);
+        pthread_create(&threads[i].thread, NULL, run_bench_thread, &threads[i]);
+    }
+
+    memset(&total, 0, sizeof total);
+    for (i = 0; i < config->threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        histogram_merge(&total.connect, &threads[i].connect);
+        histogram_merge(&total.ttfb, &threads[i].ttfb);
+        histogram_merge(&total.response, &threads[i].response);
+        total.completed += threads[i].completed;
+        total.errors += threads[i].errors;
+        total.bytes += threads[i].bytes;
+    }
+    elapsed = (now_us() - start) / 1000000.0;
+
+    printf("Requests:     %lld completed, %lld errors\n", total.completed, total.errors);
+    printf("Duration:     %.2f s with %d connections on %d threads\n", 
+           elapsed, config->concurrency, config->threads);
+    printf("Throughput:   %.1f req/s, %.2f MB/s of body\n", 
+           total.completed / elapsed, total.bytes / elapsed / (1024 * 1024));
+    printf("Latency (ms)      mean       p50       p90       p99     p99.9       max\n");
+    print_latency("connect", &total.connect);
+    print_latency("first byte", &total.ttfb);
+    print_latency("response", &total.response);
+
+    free(threads);
+    freeaddrinfo(benchAddr);
+    return 0;
+}
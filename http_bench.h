@@ -0,0 +1,16 @@
+#ifndef HTTP_BENCH_H
+#define HTTP_BENCH_H
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    const char *path;
+    int concurrency;        // Connections kept open in total
+    int threads;
+    int duration;           // Seconds, 0 for no limit
+    long long requests;     // Requests to send, 0 for no limit
+};
+
+int run_benchmark(const struct bench_config *config);
+
+#endif
@@ -0,0 +1,194 @@
+#include "http_cache.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define CACHE_PATH_SIZE 1024
+#define VALIDATOR_SIZE 256
+
+/**
+ * Sets path to the file of the URL in the cache directory with the suffix.
+ * Files are named after the FNV-1a hash of the URL
+ */
+void cache_path(const char *dir, const char *url, const char *suffix, char *path)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    const char *p;
+
+    for (p = url; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    snprintf(path, CACHE_PATH_SIZE, "%s/%016llx%s", dir, h, suffix);
+}
+
+/**
+ * Reads the validators saved for the URL. The first line of the file is the
+ * URL itself, in case another URL has the same hash.
+ * Returns 0 if the cache has nothing for the URL
+ */
+int read_validators(const char *dir, const char *url, char *etag, char *lastModified)
+{
+    char path[CACHE_PATH_SIZE], line[REQUEST_LINE_SIZE];
+    FILE *fp;
+    int match;
+
+    etag[0] = lastModified[0] = '\0';
+    cache_path(dir, url, ".meta", path);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    match = fgets(line, sizeof line, fp) != NULL && strcspn(line, "\n") == strlen(url)
+        && strncmp(line, url, strlen(url)) == 0;
+    while (match && fgets(line, sizeof line, fp) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (is_prefix("ETag: ", line)) {
+            snprintf(etag, VALIDATOR_SIZE, "%s", line + 6);
+        }
+        else if (is_prefix("Last-Modified: ", line)) {
+            snprintf(lastModified, VALIDATOR_SIZE, "%s", line + 15);
+        }
+    }
+    fclose(fp);
+    return match && (etag[0] || lastModified[0]);
+}
+
+/**
+ * Copies the file from src to dst, in the kernel.
+ * Returns the number of bytes copied, or -1 on error
+ */
+long long copy_file(const char *src, const char *dst)
+{
+    int in, out;
+    long long total = 0;
+    ssize_t n;
+
+    if ((in = open(src, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        close(in);
+        return -1;
+    }
+    while ((n = sendfile(out, in, NULL, 1024 * 1024 * 64)) > 0) {
+        total += n;
+    }
+    close(in);
+    if (close(out) < 0 || n < 0) {
+        return -1;
+    }
+    return total;
+}
+
+/**
+ * Writes the conditional header fields for the version of the URL in the
+ * cache into headers, each ending with a CRLF.
+ * Returns 0 if the cache has nothing for the URL
+ */
+int http_cache_validators(const char *dir, const char *url, char *headers, size_t sz)
+{
+    char etag[VALIDATOR_SIZE], lastModified[VALIDATOR_SIZE];
+    int len = 0;
+
+    headers[0] = '\0';
+    if (!read_validators(dir, url, etag, lastModified)) {
+        return 0;
+    }
+    if (etag[0]) {
+        len += snprintf(headers + len, sz - len, "If-None-Match: %s\r\n", etag);
+    }
+    if (lastModified[0] && (size_t)len < sz) {
+        snprintf(headers + len, sz - len, "If-Modified-Since: %s\r\n", lastModified);
+    }
+    return 1;
+}
+
+/**
+ * Saves the body of a 200 response, found in the file at bodyPath, with the
+ * validators of the response. Responses without any are dropped from the
+ * cache. The body is written before the validators that point to it, and
+ * each file is renamed into place so that readers never see half of it.
+ * Returns -1 on error
+ */
+int http_cache_store(const char *dir, const char *url, const struct http_response *res, 
+                     const char *bodyPath, long long bodyBytes)
+{
+    char etag[VALIDATOR_SIZE], lastModified[VALIDATOR_SIZE];
+    char path[CACHE_PATH_SIZE], tmp[CACHE_PATH_SIZE];
+    long long copied = -1;
+    FILE *fp;
+    int fd;
+
+    if (res->statusCode != 200) {
+        return 0;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("client: mkdir");
+        return -1;
+    }
+    if (!http_response_header(res, "ETag", etag, sizeof etag)) {
+        etag[0] = '\0';
+    }
+    if (!http_response_header(res, "Last-Modified", lastModified, sizeof lastModified)) {
+        lastModified[0] = '\0';
+    }
+    cache_path(dir, url, ".meta", path);
+    if (!etag[0] && !lastModified[0]) {
+        unlink(path);
+        return 0;
+    }
+
+    // An empty body never created the body file
+    cache_path(dir, url, ".body.tmp", tmp);
+    if (bodyBytes > 0) {
+        copied = copy_file(bodyPath, tmp);
+    }
+    else if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        copied = close(fd) < 0 ? -1 : 0;
+    }
+    if (copied != bodyBytes) {
+        unlink(tmp);
+        return -1;
+    }
+    cache_path(dir, url, ".body", path);
+    if (rename(tmp, path) < 0) {
+        return -1;
+    }
+
+    cache_path(dir, url, ".meta.tmp", tmp);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+    fprintf(fp, "%s\n", url);
+    if (etag[0]) {
+        fprintf(fp, "ETag: %s\n", etag);
+    }
+    if (lastModified[0]) {
+        fprintf(fp, "Last-Modified: %s\n", lastModified);
+    }
+    if (fclose(fp) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    cache_path(dir, url, ".meta", path);
+    return rename(tmp, path);
+}
+
+/**
+ * Copies the cached body of the URL to the file at bodyPath, after a 304.
+ * Returns the size of the body, or -1 if it is not in the cache
+ */
+long long http_cache_restore(const char *dir, const char *url, const char *bodyPath)
+{
+    char path[CACHE_PATH_SIZE];
+
+    cache_path(dir, url, ".body", path);
+    return copy_file(path, bodyPath);
+}
@@ -0,0 +1,13 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+
+int http_cache_validators(const char *dir, const char *url, char *headers, size_t sz);
+int http_cache_store(const char *dir, const char *url, const struct http_response *res, 
+                     const char *bodyPath, long long bodyBytes);
+long long http_cache_restore(const char *dir, const char *url, const char *bodyPath);
+
+#endif
@@ -7,256 +7,118 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "http_batch.h"
+#include "http_bench.h"
+#include "http_cache.h"
+#include "http_fetch.h"
+#include "http_parser.h"
 #include "utils.h"
 
-#define REQUEST_SIZE (1024 * 4)
-#define BUFFER_SIZE (1024 * 4)
-
 int printRTT = 0;
 
 void print_usage() 
 {
-    eprintf("usage: http_client [-p] server_url port_number\n");
+    eprintf("usage: http_client [-p] [-C directory] [-r | -s parts] [-b [-c connections] [-d seconds]\n"
+            "                   [-n requests] [-t threads]] server_url port_number\n");
+    eprintf("       http_client -f [-c requests] [-m requests] [-o directory] url_file port_number\n");
     eprintf("\t-p prints the RTT\n");
+    eprintf("\t-C keeps the body in the cache directory and only downloads it again if it changed\n");
+    eprintf("\t-r resumes the download where the body file left off\n");
+    eprintf("\t-s downloads the body in parts fetched in parallel over separate connections\n");
+    eprintf("\t-b benchmarks the server with keep-alive connections (10 connections on\n");
+    eprintf("\t   2 threads for 10 seconds by default) and prints throughput and latencies\n");
+    eprintf("\t-f fetches every URL of the file concurrently (64 requests in flight, at\n");
+    eprintf("\t   most -m 6 per host) and saves each body to body_<line> in -o directory\n");
 }
 
 /**
- * Gets the status code in the HTTP response status line
+ * Body sink of a download resuming a partial file. The file is only added to
+ * if the server sends the range that was asked for, and replaced otherwise
+ */
+struct resume_sink {
+    struct file_sink file;
+    const struct http_response *res;
+};
+
+/**
+ * Sets path to the file next to the body file holding the validator of the
+ * response the body came from
  */
-int get_status_code(char* statusLine)
+void validator_path(const char *bodyPath, char *path, size_t sz)
 {
-    int code = 0;
-    sscanf(statusLine, "%*s %d %*s", &code);
-    return code;
+    snprintf(path, sz, "%s.validator", bodyPath);
 }
 
-int open_socket_and_connect(const char *serverName, const char *portNumber)
+/**
+ * Saves the validator of the response next to the body file, so that a later
+ * resume only adds to the body if it is still the same representation.
+ * A response without a validator removes the one saved before
+ */
+void save_validator(const char *bodyPath, const struct http_response *res)
 {
-    int ecode;
-    struct addrinfo hints, *servInfo, *p;
-    int sockfd;
-    char ipAddress[INET6_ADDRSTRLEN];
-    double rtt = 0;
-
-    // Get host information
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    if ((ecode = getaddrinfo(serverName, portNumber, &hints, &servInfo)) != 0)
-    {
-        eprintf("getaddrinfo: %s\n", gai_strerror(ecode));
-        return -1;
-    }
+    char path[1024], validator[VALIDATOR_SIZE];
+    FILE *fp;
 
-    // Try to connect to the first working address spec
-    for (p = servInfo; p != NULL; p = p->ai_next) 
-    {
-        inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
-                  ipAddress, sizeof ipAddress);
-    
-        printf("client: connecting to %s\n", ipAddress);
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-        {
-            perror("client: socket");
-            continue;
-        }
-        start_timer();
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)
-        {
-            close(sockfd);
-            perror("client: socket");
-            continue;
-        }
-        rtt = end_timer();
-        break;
+    validator_path(bodyPath, path, sizeof path);
+    if (!http_range_validator(res, validator, sizeof validator)) {
+        unlink(path);
+        return;
     }
-
-    if (p == NULL)
-    {
-        eprintf("client: failed to connect\n");
-        return -1;
+    if ((fp = fopen(path, "w")) == NULL) {
+        perror("client: fopen");
+        return;
     }
-
-    // Get readable IP address
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), ipAddress, sizeof ipAddress);
-    printf("client: connected to %s\n", ipAddress);
-
-    if (printRTT) {
-        printf("Round-trip time = %.2f ms\n", rtt);
-    }
-
-    freeaddrinfo(servInfo);
-    return sockfd;
+    fprintf(fp, "%s\n", validator);
+    fclose(fp);
 }
 
-int send_get_request(int sockfd, const char *host, const char *path)
+/**
+ * Reads the validator saved next to the body file.
+ * Returns 0 if there is none
+ */
+int load_validator(const char *bodyPath, char *validator, size_t sz)
 {
-    char request[REQUEST_SIZE];
-    int sent = 0;
+    char path[1024];
+    FILE *fp;
+    int found;
 
-    snprintf(request, REQUEST_SIZE, 
-        "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
-        path, host);
-
-    if ((sent = send(sockfd, request, strlen(request), 0)) < 0)
-    {
-        perror("client: send");
-        return -1;
+    validator_path(bodyPath, path, sizeof path);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return 0;
     }
-
-    return sent;
+    found = fgets(validator, sz, fp) != NULL;
+    fclose(fp);
+    validator[strcspn(validator, "\r\n")] = '\0';
+    return found && validator[0];
 }
 
-int recv_http_response(int sockfd, char **status, char **headers, char **body)
-{   
-    int LEN_CRLF = strlen(CRLF);
-    int LEN_CRLFCRLF = strlen(CRLFCRLF);
-
-    int filling = 0;            // 0: status ; 1: headers; 2: body
-    int bytesRcvd;
-    int totalBytesRcvd = 0;
-    int totalBodyBytesRcvd = 0;
-    int contentLength = -1;
-    int transferEncodingChunked = 0;
-    int statusCode;
-    int noBody = 0;
-    int nextBytes;
-    int stop = 0;
-
-    char buffer[BUFFER_SIZE];
-    char *bodyChunks = NULL, *bodyChunksPtr, *bodyChunksEnd;
-    char *pch;
-    
-    *status   = (char *)malloc(max(STATUS_LINE_SIZE, BUFFER_SIZE));
-    *headers  = (char *)malloc(max(HEADER_SIZE, BUFFER_SIZE));
-    *body     = (char *)malloc(max(BODY_SIZE, BUFFER_SIZE));
-
-    *status[0] = *headers[0] = *body[0] = '\0';
+long resume_to_file(void *arg, const char *data, size_t len)
+{
+    struct resume_sink *sink = (struct resume_sink*)arg;
+    struct byte_range range;
+    char value[128];
+    off_t size;
 
-    while (1)
+    if (sink->file.fd < 0 && sink->file.keep)
     {
-        bytesRcvd = recv(sockfd, buffer, BUFFER_SIZE - 1, 0);
-        buffer[bytesRcvd] = '\0';
-
-        if (bytesRcvd <= 0) {
-            if (bytesRcvd < 0) {
-                totalBytesRcvd = bytesRcvd;
-            }
-            break;
-        }
-        totalBytesRcvd += bytesRcvd;
-        if (filling == 0)     // Filling status line buffer
-        {
-            strcat(*status, buffer);
-        }
-        else if (filling == 1) // Filling headers buffer
-        {
-            strcat(*headers, buffer);
-        }
-        else if (filling == 2) // Filling body buffer
-        {
-            if (transferEncodingChunked)
-            {
-                strcat(bodyChunks, buffer);
-            }
-            else {
-                totalBodyBytesRcvd += bytesRcvd;
-                strcat(*body, buffer);
-            }
+        if (sink->res->statusCode != 206) {
+            sink->file.offset = 0;
+            sink->file.keep = 0;
         }
-
-        if (filling == 0)
-        {
-            // If CRLF is found on status line, cut it off from there and move
-            // the cuf-off part to the headers buffer
-            if ((pch = strstr(*status, CRLF)) != NULL)
-            {
-                pch[0] = '\0';
-                strcat(*headers, pch + LEN_CRLF);           
-               
-                statusCode = get_status_code(*status);
-                noBody = statusCode == 204 || statusCode == 304 || statusCode / 100 == 1;
-
-                // Finished with filling status line, move on to headers
-                filling = 1;                 
-            }
-        }
-        if (filling == 1)
-        {
-            // If 2 consecutive CRLFs are found in header section, cut if off at between
-            // the 2 CRLFs and move the cut-off (without any CRLF) to the body buffer
-            if ((pch = strstr(*headers, CRLFCRLF)) != NULL)
-            {
-                pch[LEN_CRLF] = '\0';
-                // Some status code must not have body part
-                if (noBody) {
-                    break;
-                }
-                // Parse header and look for Transfer-Encoding or Content-Length
-                if (get_header_value(*headers, "Transfer-Encoding", buffer, BUFFER_SIZE))
-                {
-                    if ((transferEncodingChunked = (strcmp(buffer, "chunked") == 0)))
-                    {
-                        bodyChunks = (char *)malloc(BODY_SIZE);
-                        bodyChunks[0] = '\0';
-                        strcat(bodyChunks, pch + LEN_CRLFCRLF);
-                        bodyChunksPtr = bodyChunks;    
-                    }
-                }
-                else if (get_header_value(*headers, "Content-Length", buffer, BUFFER_SIZE))
-                {
-                    contentLength = atoi(buffer);
-                    strcat(*body, pch + LEN_CRLFCRLF);   
-                    totalBodyBytesRcvd = strlen(*body);                    
-                }
-                else {
-                    strcat(*body, pch + LEN_CRLFCRLF);            
-                }
-
-                // Move on to body
-                filling = 2;
-            }
-        }
-        if (filling == 2)
-        {
-            if (transferEncodingChunked)
-            {
-                bodyChunksEnd = bodyChunksPtr + strlen(bodyChunksPtr);
-                while (1) 
-                {
-                    // Get the size of the next chunk
-                    nextBytes = strtol(bodyChunksPtr, &pch, 16);
-                    
-                    if (nextBytes == 0) {
-                        stop = 1;
-                        break;
-                    }
-                    if (pch[0] == '\r' && pch[1] == '\n' 
-                        && (bodyChunksEnd - pch) >= nextBytes) 
-                    {
-                        pch += 2;
-                        strncat(*body, pch, nextBytes);
-                        bodyChunksPtr = pch + nextBytes;
-                    }
-                    else {
-                        break;
-                    }
-                }
-                if (stop) {
-                    free(bodyChunks);
-                    break;
-                }
-            }
-            else if (contentLength >= 0)
-            {
-                if (totalBodyBytesRcvd >= contentLength) break;
-            }
+        else if (!http_response_header(sink->res, "Content-Range", value, sizeof value)
+                 || !parse_content_range(value, &range, &size) || range.start != sink->file.offset) {
+            eprintf("client: the server sent another range\n");
+            return -1;
         }
     }
-    
-    return totalBytesRcvd;
+    // The validator is saved before the body, for a download cut short
+    if (sink->file.fd < 0 && !sink->file.keep) {
+        save_validator(sink->file.path, sink->res);
+    }
+    return write_to_file(&sink->file, data, len);
 }
 
 #ifndef TEST
@@ -266,10 +128,18 @@ int main(int argc, char *argv[])
     int i;
     char *host, *path;
 
-    int sockfd;    
-    int bytesRcvd;
-    FILE *bodyFile;
-    char *statusLine, *headers, *body;
+    struct http_pool *pool;
+    struct http_response res;
+    long long bytesRcvd;
+    struct resume_sink body = { { "body.html", -1, 0, 0, 0 }, &res };
+    struct file_sink *bodyFile = &body.file;
+    struct stat st;
+    char headers[1024] = "", validator[VALIDATOR_SIZE];
+    const char *cacheDir = NULL;
+    long long restored = -1;
+    int benchmark = 0, batchMode = 0, concurrency = 0, resume = 0, parts = 1;
+    struct bench_config bench = { NULL, NULL, NULL, 10, 2, 0, 0 };
+    struct batch_config batch = { NULL, NULL, ".", 64, 6 };
 
     // Parse the arguments
     if (argc <= 2) {
@@ -281,59 +151,243 @@ int main(int argc, char *argv[])
         if (strcmp("-p", argv[i]) == 0) {
             printRTT = 1;
         }
+        else if (strcmp("-C", argv[i]) == 0 && i + 1 < argc - 2) {
+            cacheDir = argv[++i];
+        }
+        else if (strcmp("-r", argv[i]) == 0) {
+            resume = 1;
+        }
+        else if (strcmp("-s", argv[i]) == 0 && i + 1 < argc - 2) {
+            parts = atoi(argv[++i]);
+        }
+        else if (strcmp("-b", argv[i]) == 0) {
+            benchmark = 1;
+        }
+        else if (strcmp("-f", argv[i]) == 0) {
+            batchMode = 1;
+        }
+        else if (strcmp("-c", argv[i]) == 0 && i + 1 < argc - 2) {
+            concurrency = atoi(argv[++i]);
+        }
+        else if (strcmp("-m", argv[i]) == 0 && i + 1 < argc - 2) {
+            batch.maxPerHost = atoi(argv[++i]);
+        }
+        else if (strcmp("-o", argv[i]) == 0 && i + 1 < argc - 2) {
+            batch.outputDir = argv[++i];
+        }
+        else if (strcmp("-d", argv[i]) == 0 && i + 1 < argc - 2) {
+            bench.duration = atoi(argv[++i]);
+        }
+        else if (strcmp("-n", argv[i]) == 0 && i + 1 < argc - 2) {
+            bench.requests = atoll(argv[++i]);
+        }
+        else if (strcmp("-t", argv[i]) == 0 && i + 1 < argc - 2) {
+            bench.threads = atoi(argv[++i]);
+        }
         else {
             eprintf("Unknown option: %s\n", argv[i]);
             return 1;
         }
     }
 
+    if (batchMode)
+    {
+        if (concurrency) {
+            batch.maxInFlight = concurrency;
+        }
+        if (batch.maxInFlight <= 0 || batch.maxPerHost <= 0) {
+            eprintf("Requests in flight must be positive\n");
+            return 1;
+        }
+        batch.urlFile = argv[argc - 2];
+        batch.defaultPort = argv[argc - 1];
+        return run_batch(&batch) != 0;
+    }
+
     parse_uri(argv[argc - 2], &host, &path);
 
-    if ((sockfd = open_socket_and_connect(host, argv[argc - 1])) < 0)
+    if (benchmark)
     {
-        return 1;
+        if (concurrency) {
+            bench.concurrency = concurrency;
+        }
+        if (bench.concurrency <= 0 || bench.threads <= 0) {
+            eprintf("Connections and threads must be positive\n");
+            return 1;
+        }
+        if (bench.duration <= 0 && bench.requests <= 0) {
+            bench.duration = 10;
+        }
+        bench.host = host;
+        bench.port = argv[argc - 1];
+        bench.path = path;
+        bench.threads = min(bench.threads, bench.concurrency);
+        return run_benchmark(&bench) < 0;
     }
 
-    if (send_get_request(sockfd, host, path) < 0)
+    pool = http_pool_new(MAX_IDLE_PER_HOST);
+    pool->verbose = 1;
+    pool->printRTT = printRTT;
+    if (parts > 1)
     {
-        return 1;
+        if ((bytesRcvd = http_fetch_parallel(pool, argv[argc - 2], argv[argc - 1], parts, 
+                                             bodyFile->path, &res)) > 0) {
+            bodyFile->bytes = bytesRcvd;
+            save_validator(bodyFile->path, &res);
+        }
     }
+    else
+    {
+        // Only the bytes missing from the body file are asked for, if the body
+        // they would be added to is known to be of the same representation
+        if (resume && stat(bodyFile->path, &st) == 0 && st.st_size > 0)
+        {
+            if (load_validator(bodyFile->path, validator, sizeof validator))
+            {
+                bodyFile->offset = st.st_size;
+                bodyFile->keep = 1;
+                snprintf(headers, sizeof headers, "Range: bytes=%lld-\r\nIf-Range: %s\r\n", 
+                         (long long)st.st_size, validator);
+            }
+            else {
+                eprintf("client: no validator saved with %s, downloading it again\n", bodyFile->path);
+            }
+        }
+        else if (cacheDir != NULL) {
+            http_cache_validators(cacheDir, argv[argc - 2], headers, sizeof headers);
+        }
+        // Ranges would be of the compressed body, so only whole bodies may come compressed
+        if (!bodyFile->keep) {
+            strncat(headers, ACCEPT_ENCODING, sizeof headers - strlen(headers) - 1);
+        }
+        bytesRcvd = http_fetch(pool, argv[argc - 2], argv[argc - 1], headers[0] ? headers : NULL, 
+                               &res, resume_to_file, &body);
 
-    bytesRcvd = recv_http_response(sockfd, &statusLine, &headers, &body);
+        if (bytesRcvd > 0 && cacheDir != NULL && !bodyFile->keep)
+        {
+            if (res.statusCode == 304) {
+                restored = http_cache_restore(cacheDir, argv[argc - 2], bodyFile->path);
+            }
+            else if (http_cache_store(cacheDir, argv[argc - 2], &res, bodyFile->path, bodyFile->bytes) < 0) {
+                eprintf("client: could not save the body in the cache\n");
+            }
+        }
+    }
 
     if (bytesRcvd > 0)
     {
-        printf("\n%s\n%s\n", statusLine, headers);
+        // The head ends with the CRLF of the last field and an empty line
+        printf("\n%.*s\n%.*s\n", res.statusLength, res.head, 
+               res.headLength - res.statusLength - 2 * (int)strlen(CRLF), 
+               res.head + res.statusLength + strlen(CRLF));
         printf("--------------\n");
-        if (body[0] == '\0')
+        if (bodyFile->keep && res.statusCode == 416)
+        {
+            printf("Body file %s is already complete (%lld bytes)\n\n", bodyFile->path, bodyFile->offset);
+        }
+        else if (res.statusCode == 304 && restored >= 0)
+        {
+            printf("Body not modified, copied from the cache to %s (%lld bytes)\n\n", bodyFile->path, restored);
+        }
+        else if (bodyFile->bytes == 0)
         {
             printf("Body is empty.\n\n");
         }
+        else if (bodyFile->keep) {
+            printf("Body file saved to %s (%lld bytes, resumed at %lld)\n\n", bodyFile->path, 
+                   bodyFile->offset + bodyFile->bytes, bodyFile->offset);
+        }
         else {
-            bodyFile = fopen("body.html", "w");
-            fprintf(bodyFile, "%s", body);
-            fclose(bodyFile);
-            printf("Body file saved to body.html\n\n");
+            printf("Body file saved to %s (%lld bytes)\n\n", bodyFile->path, bodyFile->bytes);
         }
     }
     else {
         printf("client: received nothing from server or error occured\n");
     }
+    if (bodyFile->fd >= 0) {
+        close(bodyFile->fd);
+    }
 
-    free(statusLine);
-    free(headers);
-    free(body);
-
-    close(sockfd);
+    http_pool_free(pool);
+    free(host);
+    free(path);
 
     return 0;
 }
 
 #else
 
+char testBody[256];
+size_t testBodyLength;
+
+long write_to_test_body(void *arg, const char *data, size_t len)
+{
+    memcpy(testBody + testBodyLength, data, len);
+    testBodyLength += len;
+    return len;
+}
+
+/**
+ * Answers each request of one connection, pipelined or not, with its path
+ * as the body, until the client closes it
+ */
+void *serve_test_requests(void *argument)
+{
+    int listenfd = (int)(long)argument, fd, n;
+    char buf[4096], response[256], path[64];
+    char *end;
+    size_t len = 0;
+
+    if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+        return NULL;
+    }
+    while ((n = recv(fd, buf + len, sizeof buf - 1 - len, 0)) > 0)
+    {
+        len += n;
+        buf[len] = '\0';
+        while ((end = strstr(buf, "\r\n\r\n")) != NULL)
+        {
+            if (sscanf(buf, "GET %63s", path) != 1) {
+                strcpy(path, "?");
+            }
+            n = snprintf(response, sizeof response, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n%s",
+                         strlen(path), path);
+            send(fd, response, n, MSG_NOSIGNAL);
+            end += 4;
+            len -= end - buf;
+            memmove(buf, end, len + 1);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
-    char *ptr1, *ptr2;
+    char *ptr1, *ptr2, *ptr3;
+    char ringData[8];
+    struct ring_buffer ring;
+    struct body_decoder dec;
+    struct header_index index;
+    size_t len;
+    long consumed;
+    int i, ok, parts;
+    struct histogram hist;
+    struct arena arena;
+    struct byte_range range;
+    off_t size;
+    char port[16], date[HTTP_DATE_SIZE];
+    char text[200], gzipped[256], message[512];
+    struct http_response res;
+    z_stream zs;
+    static struct http_response responses[3];
+    const char *paths[] = { "/a", "/bb", "/ccc" };
+    char longPath[REQUEST_LINE_SIZE * 2];
+    struct http_pool *pool;
+    struct sockaddr_in addr;
+    socklen_t addrLength = sizeof addr;
+    pthread_t server;
+    int listenfd;
 
     check("Test get_status_code 1", get_status_code("HTTP/1.1 200 OK") == 200);
     check("Test get_status_code 2", get_status_code("HTTP/1.1 300 OK") == 300);
@@ -345,13 +399,173 @@ int main(int argc, char *argv[])
     free(ptr1);
     free(ptr2);
 
+    parse_uri("localhost:9999/index.html", &ptr1, &ptr2);
+    split_host_port(ptr1, "80", port, sizeof port);
+    check("Test split_host_port", strcmp(ptr1, "localhost") == 0 && strcmp(port, "9999") == 0);
+    split_host_port(ptr1, "80", port, sizeof port);
+    check("Test split_host_port (default)", strcmp(ptr1, "localhost") == 0 && strcmp(port, "80") == 0);
+    free(ptr1);
+    free(ptr2);
+
     ptr1 = (char*)malloc(100);
     get_header_value("field1: xxx\r\nfield2:   yyyy", "field1", ptr1, 100);
     check("Test get_header_value", strcmp(ptr1, "xxx") == 0);
     get_header_value("field1: xxx\r\nfield2:   yyyy", "field2", ptr1, 100);
     check("Test get_header_value", strcmp(ptr1, "yyyy") == 0);
+    get_header_value("Field1: xxx\r\nfield2:   yyyy", "FIELD1", ptr1, 100);
+    check("Test get_header_value (case)", strcmp(ptr1, "xxx") == 0);
+    check("Test get_header_value (missing)", !get_header_value("field1: xxx\r\n", "field", ptr1, 100));
     free(ptr1);
 
+    ptr1 = "0123456789abcdef0123456789abcdef0123456789:abcdef\r\n\r\nxyz";
+    check("Test scan_until", scan_until(ptr1, ptr1 + strlen(ptr1), ':', '\n', '\n', '\n') == ptr1 + 42);
+    check("Test scan_until (none)", scan_until(ptr1, ptr1 + 42, ':', ':', ':', ':') == ptr1 + 42);
+    check("Test find_header_end", find_header_end(ptr1, ptr1 + strlen(ptr1)) == ptr1 + 49);
+    check("Test find_header_end (none)", find_header_end(ptr1, ptr1 + 51) == NULL);
+
+    ring_init(&ring, ringData, sizeof ringData);
+    ring_write_ptr(&ring, &len);
+    ring_produce(&ring, 6);
+    ring_consume(&ring, 4);
+    ring_write_ptr(&ring, &len);
+    check("Test ring_write_ptr (wrap)", len == 2);
+    ring_produce(&ring, 2);
+    ring_read_ptr(&ring, &len);
+    check("Test ring_read_ptr", len == 4 && ring_readable(&ring) == 4);
+
+    check("Test parse_content_range", parse_content_range("bytes 10-19/100", &range, &size)
+                                      && range.start == 10 && range.end == 20 && size == 100);
+    check("Test parse_content_range (unknown size)", parse_content_range("bytes 0-0/*", &range, &size)
+                                                     && size == -1);
+    check("Test parse_content_range (malformed)", !parse_content_range("bytes */100", &range, &size)
+                                                  && !parse_content_range("bytes 5-200/100", &range, &size));
+
+    format_http_date(784111777, date, sizeof date);
+    check("Test format_http_date", strcmp(date, "Sun, 06 Nov 1994 08:49:37 GMT") == 0);
+    check("Test parse_http_date", parse_http_date(date) == 784111777);
+    check("Test parse_http_date (malformed)", parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT") == -1);
+
+    arena_init(&arena, 64);
+    ptr1 = (char*)arena_alloc(&arena, 10);
+    ptr2 = arena_strdup(&arena, "abc");
+    check("Test arena_alloc", ptr2 == ptr1 + 16 && strcmp(ptr2, "abc") == 0);
+    ptr2 = (char*)arena_alloc(&arena, 100);
+    check("Test arena_alloc (oversized)", ptr2 != NULL && arena.head->size == 112);
+    ptr3 = (char*)arena_alloc(&arena, 40);
+    arena_reset(&arena);
+    check("Test arena_reset", arena_alloc(&arena, 8) == ptr1 && arena.head->next == NULL);
+    check("Test arena_reset (spare block)", arena_alloc(&arena, 60) == ptr3 && arena.spare == NULL);
+    arena_free(&arena);
+
+    ptr1 = "Content-Length: 6\r\n";
+    index_headers(ptr1, strlen(ptr1), &index);
+    body_decoder_init(&dec, 200, &index, ptr1);
+    check("Test decode_body (length)", decode_body(&dec, "abcdefXYZ", 9, write_to_test_body, NULL) == 6);
+    check("Test decode_body (length done)", dec.done && testBodyLength == 6 
+                                            && memcmp(testBody, "abcdef", 6) == 0);
+    body_decoder_init(&dec, 304, &index, ptr1);
+    check("Test decode_body (no body)", dec.done);
+
+    // Chunked body with an extension, a NUL byte and a trailer, split at every position
+    ptr1 = "Transfer-Encoding: chunked\r\n";
+    index_headers(ptr1, strlen(ptr1), &index);
+    ptr2 = "3;name=value\r\na\0b\r\nA\r\n0123456789\r\n0\r\nTrailer: x\r\n\r\nNEXT";
+    len = 55;
+    for (i = 0, ok = 1; i <= (int)len && ok; i++)
+    {
+        testBodyLength = 0;
+        body_decoder_init(&dec, 200, &index, ptr1);
+        consumed = decode_body(&dec, ptr2, i, write_to_test_body, NULL);
+        consumed += decode_body(&dec, ptr2 + consumed, len - consumed, write_to_test_body, NULL);
+        ok = dec.done && consumed == (long)len - 4 && testBodyLength == 13
+             && memcmp(testBody, "a\0b0123456789", 13) == 0;
+    }
+    check("Test decode_body (chunked)", ok);
+    body_decoder_init(&dec, 200, &index, ptr1);
+    check("Test decode_body (bad chunk size)", decode_body(&dec, "x\r\n", 3, write_to_test_body, NULL) < 0);
+    body_decoder_init(&dec, 200, &index, ptr1);
+    check("Test decode_body (bad chunk end)", decode_body(&dec, "1\r\nab\r\n", 7, write_to_test_body, NULL) < 0);
+
+    // Gzipped body fed to the parser a byte at a time
+    for (i = 0; i < (int)sizeof text; i++) {
+        text[i] = "abcabd\n"[i % 7];
+    }
+    memset(&zs, 0, sizeof zs);
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef*)text;
+    zs.avail_in = sizeof text;
+    zs.next_out = (Bytef*)gzipped;
+    zs.avail_out = sizeof gzipped;
+    deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    len = snprintf(message, sizeof message, "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+                   "Transfer-Encoding: chunked\r\n\r\n%lx\r\n", zs.total_out);
+    memcpy(message + len, gzipped, zs.total_out);
+    len += zs.total_out;
+    len += snprintf(message + len, sizeof message - len, "\r\n0\r\n\r\n");
+    testBodyLength = 0;
+    http_response_init(&res);
+    for (i = 0; i < (int)len; i++) {
+        if (parse_http_response(&res, message + i, 1, write_to_test_body, NULL) != 1) {
+            break;
+        }
+    }
+    check("Test parse_http_response (gzip)", i == (int)len && res.body.done && res.content == NULL
+                                             && testBodyLength == sizeof text 
+                                             && memcmp(testBody, text, sizeof text) == 0);
+    http_response_init(&res);
+    check("Test parse_http_response (bad gzip)", 
+          parse_http_response(&res, "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 4\r\n\r\nabcd",
+                              67, write_to_test_body, NULL) < 0 && res.content == NULL);
+    http_response_init(&res);
+    strcpy(message, "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc");
+    check("Test parse_response_head", parse_response_head(&res, message, 10) == 10 && !res.headDone
+                                      && parse_response_head(&res, message + 10, 35) == 28 && res.headDone
+                                      && res.body.framing == BODY_LENGTH && res.body.remaining == 3);
+
+    memset(&hist, 0, sizeof hist);
+    for (i = 1; i <= 1000; i++) {
+        histogram_record(&hist, i * 10);
+    }
+    check("Test histogram_percentile (p50)", labs(histogram_percentile(&hist, 0.5) - 5000) <= 5000 / 32);
+    check("Test histogram_percentile (p99)", labs(histogram_percentile(&hist, 0.99) - 9900) <= 9900 / 32);
+    check("Test histogram_percentile (max)", histogram_percentile(&hist, 1) == 10000);
+
+    // Parts of 2 bytes cover 10 bytes in 5, a sixth would be empty
+    parts = 6;
+    check("Test split_size", split_size(10, &parts) == 2 && parts == 5);
+    parts = 3;
+    check("Test split_size (last part shorter)", split_size(7, &parts) == 3 && parts == 3);
+    parts = 8;
+    check("Test split_size (fewer bytes than parts)", split_size(3, &parts) == 1 && parts == 3);
+
+    // A server on a free port answers with the path of each request
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listenfd, (struct sockaddr*)&addr, sizeof addr);
+    listen(listenfd, 1);
+    getsockname(listenfd, (struct sockaddr*)&addr, &addrLength);
+    snprintf(port, sizeof port, "%d", ntohs(addr.sin_port));
+    pthread_create(&server, NULL, serve_test_requests, (void*)(long)listenfd);
+    pool = http_pool_new(1);
+    testBodyLength = 0;
+    ok = http_fetch_pipelined(pool, "127.0.0.1", port, paths, 3, responses, write_to_test_body, NULL) == 3;
+    for (i = 0; i < 3; i++) {
+        ok = ok && responses[i].statusCode == 200;
+    }
+    check("Test http_fetch_pipelined", ok && testBodyLength == 9 && memcmp(testBody, "/a/bb/ccc", 9) == 0);
+    memset(longPath, 'x', sizeof longPath - 1);
+    longPath[0] = '/';
+    longPath[sizeof longPath - 1] = '\0';
+    paths[0] = longPath;
+    check("Test http_fetch_pipelined (too long)", http_fetch_pipelined(pool, "127.0.0.1", port, paths, 1, responses,
+                                                                        write_to_test_body, NULL) == 0);
+    http_pool_free(pool);
+    pthread_join(server, NULL);
+    close(listenfd);
+
     return 0;
 }
 
@@ -0,0 +1,577 @@
+#include "http_fetch.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define REQUEST_SIZE (1024 * 4)
+
+struct http_pool *http_pool_new(int maxIdle)
+{
+    struct http_pool *pool = (struct http_pool*)calloc(1, sizeof(struct http_pool));
+    pool->maxIdle = min(maxIdle, MAX_IDLE_PER_HOST);
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void http_pool_free(struct http_pool *pool)
+{
+    struct pooled_host *h, *next;
+    int i;
+
+    for (h = pool->hosts; h != NULL; h = next)
+    {
+        next = h->next;
+        for (i = 0; i < h->numIdle; i++) {
+            close(h->idle[i]);
+        }
+        freeaddrinfo(h->addr);
+        free(h->host);
+        free(h->port);
+        free(h);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/**
+ * Returns the origin, resolving its addresses the first time it is used.
+ * Must be called with the lock held
+ */
+struct pooled_host *get_host(struct http_pool *pool, const char *host, const char *port)
+{
+    struct pooled_host *h;
+    struct addrinfo hints, *addr;
+    int ecode;
+
+    for (h = pool->hosts; h != NULL; h = h->next) {
+        if (strcmp(h->host, host) == 0 && strcmp(h->port, port) == 0) {
+            return h;
+        }
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    pool->lookups++;
+    if ((ecode = getaddrinfo(host, port, &hints, &addr)) != 0)
+    {
+        eprintf("getaddrinfo: %s\n", gai_strerror(ecode));
+        return NULL;
+    }
+    h = (struct pooled_host*)calloc(1, sizeof(struct pooled_host));
+    h->host = strdup(host);
+    h->port = strdup(port);
+    h->addr = addr;
+    h->next = pool->hosts;
+    pool->hosts = h;
+    return h;
+}
+
+/**
+ * Connects to the first working address of the origin
+ */
+int connect_to_host(struct http_pool *pool, struct pooled_host *h)
+{
+    struct addrinfo *p;
+    char ipAddress[INET6_ADDRSTRLEN];
+    int sockfd;
+    double rtt = 0;
+
+    for (p = h->addr; p != NULL; p = p->ai_next) 
+    {
+        inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
+                  ipAddress, sizeof ipAddress);
+        if (pool->verbose) {
+            printf("client: connecting to %s\n", ipAddress);
+        }
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+        {
+            perror("client: socket");
+            continue;
+        }
+        start_timer();
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)
+        {
+            close(sockfd);
+            perror("client: connect");
+            continue;
+        }
+        rtt = end_timer();
+        break;
+    }
+
+    if (p == NULL)
+    {
+        eprintf("client: failed to connect\n");
+        return -1;
+    }
+    if (pool->verbose) {
+        printf("client: connected to %s\n", ipAddress);
+    }
+    if (pool->printRTT) {
+        printf("Round-trip time = %.2f ms\n", rtt);
+    }
+    return sockfd;
+}
+
+/**
+ * Returns whether the idle connection was closed by the server, or has
+ * bytes waiting that no request asked for
+ */
+int is_stale(int sockfd)
+{
+    char c;
+    ssize_t n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/**
+ * Takes an idle connection to the origin from the pool, or opens a new one.
+ * Sets reused to whether the connection was idle in the pool
+ */
+int acquire_connection(struct http_pool *pool, const char *host, const char *port, int *reused)
+{
+    struct pooled_host *h;
+    int sockfd = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((h = get_host(pool, host, port)) == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    while (h->numIdle > 0 && sockfd < 0)
+    {
+        sockfd = h->idle[--h->numIdle];
+        if (is_stale(sockfd)) {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    if ((*reused = sockfd >= 0)) {
+        pool->reuses++;
+    }
+    else {
+        pool->connects++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (sockfd < 0) {
+        sockfd = connect_to_host(pool, h);
+    }
+    return sockfd;
+}
+
+/**
+ * Gives the connection back to the pool if it can take another request,
+ * closes it otherwise
+ */
+void release_connection(struct http_pool *pool, const char *host, const char *port, 
+                        int sockfd, int keepAlive)
+{
+    struct pooled_host *h;
+
+    pthread_mutex_lock(&pool->lock);
+    h = get_host(pool, host, port);
+    if (keepAlive && h != NULL && h->numIdle < pool->maxIdle) {
+        h->idle[h->numIdle++] = sockfd;
+        sockfd = -1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (sockfd >= 0) {
+        close(sockfd);
+    }
+}
+
+int send_all(int sockfd, const char *data, int len)
+{
+    int sent = 0, n;
+    while (sent < len) {
+        if ((n = send(sockfd, data + sent, len - sent, MSG_NOSIGNAL)) < 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+/**
+ * Receives one response, starting with the bytes already in the ring buffer.
+ * The status line and header are kept in res and the body is streamed to the
+ * sink, so memory use does not depend on the size of the body. Bytes after
+ * the response, such as the next pipelined response, are left in the ring.
+ * Returns the number of bytes received, 0 if the connection was closed before
+ * the response started, or -1 on error
+ */
+long long recv_http_response(int sockfd, struct ring_buffer *ring, struct http_response *res, 
+                             body_sink sink, void *arg)
+{   
+    long long totalBytes = 0;
+    int bytesRcvd;
+    long consumed;
+    size_t len;
+    char *ptr;
+
+    http_response_init(res);
+    while (1)
+    {
+        while (ring_readable(ring) > 0 && !res->body.done)
+        {
+            ptr = ring_read_ptr(ring, &len);
+            if ((consumed = parse_http_response(res, ptr, len, sink, arg)) < 0) {
+                return -1;
+            }
+            ring_consume(ring, consumed);
+            totalBytes += consumed;
+            if (consumed == 0) {
+                break;
+            }
+        }
+        if (res->body.done) {
+            return totalBytes;
+        }
+
+        // What the sink does not take right away waits in the ring buffer
+        ptr = ring_write_ptr(ring, &len);
+        if (len == 0) {
+            continue;
+        }
+        if ((bytesRcvd = recv(sockfd, ptr, len, 0)) < 0) {
+            http_response_free(res);
+            return -1;
+        }
+        if (bytesRcvd == 0)
+        {
+            http_response_free(res);
+            if (res->headLength == 0 && ring_readable(ring) == 0) {
+                return 0;
+            }
+            if (!res->headDone || body_decoder_eof(&res->body) < 0) {
+                eprintf("client: connection closed before the end of the response\n");
+                return -1;
+            }
+            return totalBytes;
+        }
+        ring_produce(ring, bytesRcvd);
+    }
+}
+
+/**
+ * Splits host[:port] into the host and the port, using defaultPort if there
+ * is none
+ */
+void split_host_port(char *host, const char *defaultPort, char *port, size_t sz)
+{
+    char *colon = strrchr(host, ':');
+    if (colon != NULL && strchr(colon, ']') == NULL) {
+        *colon = '\0';
+        snprintf(port, sz, "%s", colon + 1);
+    }
+    else {
+        snprintf(port, sz, "%s", defaultPort);
+    }
+}
+
+/**
+ * Fetches the URL with a GET request over an idle connection to its origin
+ * if the pool has one, without resolving the host again. headers holds extra
+ * header fields for the request, each ending with a CRLF, or is NULL. A
+ * request on an idle connection the server closed in the meantime is retried
+ * once on a new connection.
+ * Returns the number of bytes received, or -1 on error
+ */
+long long http_fetch(struct http_pool *pool, const char *url, const char *defaultPort,
+                     const char *headers, struct http_response *res, body_sink sink, void *arg)
+{
+    char *host, *path;
+    char port[16], request[REQUEST_SIZE];
+    char ringData[FETCH_RING_SIZE];
+    struct ring_buffer ring;
+    int sockfd, reused, len, attempt;
+    long long rv = -1;
+
+    parse_uri(url, &host, &path);
+    split_host_port(host, defaultPort, port, sizeof port);
+    len = snprintf(request, REQUEST_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", 
+                   path, host, headers != NULL ? headers : "");
+    if (len >= REQUEST_SIZE)
+    {
+        eprintf("client: request too large\n");
+        free(host);
+        free(path);
+        return -1;
+    }
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        if ((sockfd = acquire_connection(pool, host, port, &reused)) < 0) {
+            break;
+        }
+        ring_init(&ring, ringData, FETCH_RING_SIZE);
+        if (send_all(sockfd, request, len) < 0) {
+            rv = -1;
+        }
+        else {
+            rv = recv_http_response(sockfd, &ring, res, sink, arg);
+        }
+        if (rv <= 0 && reused && res->headLength == 0) {
+            // The server closed the idle connection
+            close(sockfd);
+            rv = -1;
+            continue;
+        }
+        release_connection(pool, host, port, sockfd, rv > 0 && res->keepAlive);
+        break;
+    }
+
+    free(host);
+    free(path);
+    return rv;
+}
+
+/**
+ * Fetches the paths from the origin by sending all the requests at once on
+ * one connection and receiving the responses in order. The body of
+ * responses[i] goes to the sink with args[i]. If the server closes the
+ * connection early, the requests left are sent again on a new one. The
+ * requests must fit in n * REQUEST_SIZE bytes together.
+ * Returns the number of responses received
+ */
+int http_fetch_pipelined(struct http_pool *pool, const char *host, const char *port,
+                         const char **paths, int n, struct http_response *responses, 
+                         body_sink sink, void **args)
+{
+    size_t size = (size_t)n * REQUEST_SIZE, len;
+    char *requests = (char*)malloc(size);
+    char ringData[FETCH_RING_SIZE];
+    struct ring_buffer ring;
+    int done = 0, start, i, w, sockfd, reused, keepAlive, failures = 0;
+    long long rv;
+
+    if (requests == NULL) {
+        perror("malloc");
+        return 0;
+    }
+    while (done < n && failures < 2)
+    {
+        for (i = done, len = 0; i < n; i++)
+        {
+            w = snprintf(requests + len, size - len, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", paths[i], host);
+            if (w < 0 || (size_t)w >= size - len) {
+                eprintf("client: the requests do not fit in %zu bytes\n", size);
+                free(requests);
+                return done;
+            }
+            len += w;
+        }
+        if ((sockfd = acquire_connection(pool, host, port, &reused)) < 0) {
+            break;
+        }
+        ring_init(&ring, ringData, FETCH_RING_SIZE);
+        keepAlive = send_all(sockfd, requests, len) >= 0;
+
+        start = done;
+        while (keepAlive && done < n)
+        {
+            rv = recv_http_response(sockfd, &ring, &responses[done], sink, args ? args[done] : NULL);
+            if (rv <= 0) {
+                // Part of a body may have reached the sink already, so a
+                // response whose body started cannot be asked for again
+                if (rv < 0 && responses[done].headDone) {
+                    failures = 2;
+                }
+                keepAlive = 0;
+                break;
+            }
+            keepAlive = responses[done++].keepAlive;
+        }
+        // Only a connection that answered every request can take more
+        release_connection(pool, host, port, sockfd, keepAlive && done == n);
+        if (done == start) {
+            failures++;
+        }
+    }
+    free(requests);
+    return done;
+}
+
+/**
+ * Writes the body bytes to the file of the sink, creating it on first use.
+ * Several sinks can write different parts of the same file
+ */
+long write_to_file(void *arg, const char *data, size_t len)
+{
+    struct file_sink *sink = (struct file_sink*)arg;
+    size_t written = 0;
+    ssize_t n;
+
+    if (sink->fd < 0 && (sink->fd = open(sink->path, O_WRONLY | O_CREAT | (sink->keep ? 0 : O_TRUNC), 
+                                         0644)) < 0) {
+        perror("client: open");
+        return -1;
+    }
+    while (written < len) {
+        if ((n = pwrite(sink->fd, data + written, len - written, 
+                        sink->offset + sink->bytes + written)) < 0) {
+            perror("client: write");
+            return -1;
+        }
+        written += n;
+    }
+    sink->bytes += len;
+    return len;
+}
+
+/**
+ * Copies the validator of the response that If-Range can be given to ask for
+ * a range of the same representation: a strong ETag, or else Last-Modified.
+ * Returns 0 if the response has neither
+ */
+int http_range_validator(const struct http_response *res, char *buf, size_t sz)
+{
+    if (http_response_header(res, "ETag", buf, sz) && buf[0] == '"') {
+        return 1;
+    }
+    return http_response_header(res, "Last-Modified", buf, sz);
+}
+
+struct range_part {
+    struct http_pool *pool;
+    const char *url;
+    const char *defaultPort;
+    const char *validator;
+    struct byte_range range;
+    struct file_sink sink;
+    struct http_response res;
+    pthread_t thread;
+    int ok;
+};
+
+/**
+ * Body sink of a part. A response other than 206 means the file changed since
+ * it was probed, or the server ignored the range, and its body is not written
+ */
+long write_to_part(void *arg, const char *data, size_t len)
+{
+    struct range_part *part = (struct range_part*)arg;
+
+    if (part->res.statusCode != 206) {
+        eprintf("client: got %d instead of bytes %lld-%lld\n", part->res.statusCode,
+                (long long)part->range.start, (long long)part->range.end - 1);
+        return -1;
+    }
+    return write_to_file(&part->sink, data, len);
+}
+
+void *fetch_range_part(void *argument)
+{
+    struct range_part *part = (struct range_part*)argument;
+    char headers[64 + VALIDATOR_SIZE];
+
+    snprintf(headers, sizeof headers, "Range: bytes=%lld-%lld\r\nIf-Range: %s\r\n",
+             (long long)part->range.start, (long long)part->range.end - 1, part->validator);
+    part->ok = http_fetch(part->pool, part->url, part->defaultPort, headers, &part->res, 
+                          write_to_part, part) > 0
+        && part->res.statusCode == 206 
+        && part->sink.bytes == part->range.end - part->range.start;
+    if (part->sink.fd >= 0) {
+        close(part->sink.fd);
+    }
+    return NULL;
+}
+
+/**
+ * Returns the size of the parts a file of size bytes is split in, at most
+ * *parts of them, and sets *parts to how many there are. Rounding the size
+ * up may take fewer parts than asked for, but leaves none of them empty
+ */
+off_t split_size(off_t size, int *parts)
+{
+    off_t partSize;
+
+    *parts = (int)max(1, min((off_t)*parts, size));
+    partSize = max((size + *parts - 1) / *parts, 1);
+    *parts = (int)max((size + partSize - 1) / partSize, 1);
+    return partSize;
+}
+
+/**
+ * Downloads the URL to the file in parts fetched in parallel with Range
+ * requests, each on its own connection. The first byte is asked for alone to
+ * learn the size of the file, and the response to that request is kept in
+ * res. A server without range support sends the whole body in answer to it
+ * instead, which is saved as it is. The parts are asked for with If-Range and
+ * the validator of that response, so a file changing in the meantime fails
+ * the download instead of mixing two versions, and so does a response without
+ * a validator.
+ * Returns the number of bytes saved, or -1 on error
+ */
+long long http_fetch_parallel(struct http_pool *pool, const char *url, const char *defaultPort,
+                              int parts, const char *path, struct http_response *res)
+{
+    struct file_sink sink = { path, -1, 0, 0, 0 };
+    struct range_part *part;
+    struct byte_range range;
+    char value[128], validator[VALIDATOR_SIZE];
+    off_t size, partSize;
+    long long rv;
+    int i, failed = 0;
+
+    rv = http_fetch(pool, url, defaultPort, "Range: bytes=0-0\r\n", res, write_to_file, &sink);
+    if (sink.fd >= 0) {
+        close(sink.fd);
+    }
+    if (rv <= 0 || res->statusCode != 206) {
+        return rv <= 0 ? -1 : sink.bytes;
+    }
+    if (!http_response_header(res, "Content-Range", value, sizeof value)
+        || !parse_content_range(value, &range, &size) || size < 0)
+    {
+        eprintf("client: no file size in the partial response\n");
+        return -1;
+    }
+    if (!http_range_validator(res, validator, sizeof validator))
+    {
+        eprintf("client: no ETag or Last-Modified to ask for the parts with\n");
+        return -1;
+    }
+
+    partSize = split_size(size, &parts);
+    if ((part = (struct range_part*)calloc(parts, sizeof(struct range_part))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (i = 0; i < parts; i++)
+    {
+        part[i].pool = pool;
+        part[i].url = url;
+        part[i].defaultPort = defaultPort;
+        part[i].validator = validator;
+        part[i].range.start = i * partSize;
+        part[i].range.end = min((i + 1) * partSize, size);
+        part[i].sink.path = path;
+        part[i].sink.fd = -1;
+        part[i].sink.offset = part[i].range.start;
+        part[i].sink.keep = 1;
+        pthread_create(&part[i].thread, NULL, fetch_range_part, &part[i]);
+    }
+    for (i = 0; i < parts; i++)
+    {
+        pthread_join(part[i].thread, NULL);
+        if (!part[i].ok) {
+            eprintf("client: failed to fetch bytes %lld-%lld\n",
+                    (long long)part[i].range.start, (long long)part[i].range.end - 1);
+            failed = 1;
+        }
+    }
+    free(part);
+    return failed ? -1 : size;
+}
@@ -0,0 +1,65 @@
+#ifndef HTTP_FETCH_H
+#define HTTP_FETCH_H
+
+#include <pthread.h>
+
+#include "http_parser.h"
+#include "utils.h"
+
+#define MAX_IDLE_PER_HOST 16
+#define FETCH_RING_SIZE (1024 * 64)
+#define VALIDATOR_SIZE 256      // Longest ETag or Last-Modified kept for If-Range
+
+/**
+ * Origin the pool has talked to, with its resolved addresses and the
+ * connections to it that are open and idle
+ */
+struct pooled_host {
+    char *host;
+    char *port;
+    struct addrinfo *addr;
+    int idle[MAX_IDLE_PER_HOST];
+    int numIdle;
+    struct pooled_host *next;
+};
+
+struct http_pool {
+    struct pooled_host *hosts;
+    int maxIdle;
+    int verbose;            // Prints each new connection
+    int printRTT;           // Prints the RTT of each new connection
+    long long lookups;
+    long long connects;
+    long long reuses;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Body sink writing to a file, for write_to_file
+ */
+struct file_sink {
+    const char *path;
+    int fd;                 // Opened when the first body byte arrives
+    long long bytes;
+    long long offset;       // Where the first body byte goes in the file
+    int keep;               // Keeps the content of the file instead of truncating it
+};
+
+struct http_pool *http_pool_new(int maxIdle);
+void http_pool_free(struct http_pool *pool);
+
+void split_host_port(char *host, const char *defaultPort, char *port, size_t sz);
+long long recv_http_response(int sockfd, struct ring_buffer *ring, struct http_response *res, 
+                             body_sink sink, void *arg);
+long long http_fetch(struct http_pool *pool, const char *url, const char *defaultPort,
+                     const char *headers, struct http_response *res, body_sink sink, void *arg);
+int http_fetch_pipelined(struct http_pool *pool, const char *host, const char *port,
+                         const char **paths, int n, struct http_response *responses, 
+                         body_sink sink, void **args);
+int http_range_validator(const struct http_response *res, char *buf, size_t sz);
+off_t split_size(off_t size, int *parts);
+long long http_fetch_parallel(struct http_pool *pool, const char *url, const char *defaultPort,
+                              int parts, const char *path, struct http_response *res);
+long write_to_file(void *arg, const char *data, size_t len);
+
+#endif
@@ -0,0 +1,874 @@
+#include "http_parser.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+// States of the request parser
+#define S_START 0           // Empty lines before the request line
+#define S_METHOD 1
+#define S_URI 2
+#define S_VERSION 3
+#define S_LINE_LF 4         // CR seen at the end of a line
+#define S_HEADER_START 5
+#define S_HEADER_NAME 6
+#define S_VALUE_START 7
+#define S_VALUE 8
+#define S_END_LF 9          // CR seen on the empty line ending the header
+#define S_DONE 10
+#define S_ERROR 11
+
+#define INFLATE_BUFFER_SIZE (1024 * 16)
+
+// States of the chunked body decoder
+#define C_SIZE 0            // Hex digits of the chunk size
+#define C_EXT 1             // Chunk extensions, ignored
+#define C_SIZE_LF 2
+#define C_DATA 3
+#define C_DATA_CR 4         // CRLF after the chunk data
+#define C_DATA_LF 5
+#define C_TRAILER 6         // Start of a trailer line, or of the final empty line
+#define C_TRAILER_LINE 7    // Trailer fields, ignored
+#define C_END_LF 8
+
+void http_request_init(struct http_request *req)
+{
+    memset(req, 0, sizeof(struct http_request));
+    req->state = S_START;
+}
+
+/**
+ * Ends the token started at tokenStart right before pos and terminates it in place
+ */
+void end_token(struct http_request *req, char *buf, struct http_slice *slice)
+{
+    slice->offset = req->tokenStart;
+    slice->length = req->pos - req->tokenStart;
+    buf[req->pos] = '\0';
+}
+
+/**
+ * Parses the request line and header in buf, resuming after the bytes parsed
+ * by the previous call. len is the number of bytes received so far, and
+ * bytes before it are never looked at twice.
+ * Returns PARSE_DONE once the header is complete, PARSE_AGAIN if more bytes
+ * are needed and PARSE_ERROR if the request is malformed
+ */
+int parse_http_request(struct http_request *req, char *buf, int len)
+{
+    struct header_field *field;
+    char c;
+
+    for (; req->pos < len; req->pos++)
+    {
+        // Inside a token only its delimiters matter, so skip to the next one
+        if (req->state == S_URI) {
+            req->pos = scan_until(buf + req->pos, buf + len, ' ', '\r', '\n', '\0') - buf;
+        }
+        else if (req->state == S_HEADER_NAME) {
+            req->pos = scan_until(buf + req->pos, buf + len, ':', '\r', '\n', ' ') - buf;
+        }
+        else if (req->state == S_VALUE) {
+            req->pos = scan_until(buf + req->pos, buf + len, '\r', '\n', '\0', '\0') - buf;
+        }
+        if (req->pos == len) {
+            break;
+        }
+
+        c = buf[req->pos];
+        switch (req->state)
+        {
+        case S_START:
+            if (c == '\r' || c == '\n') {
+                break;
+            }
+            req->tokenStart = req->pos;
+            req->state = S_METHOD;
+            // Fall through
+        case S_METHOD:
+            if (c == ' ') {
+                end_token(req, buf, &req->method);
+                req->tokenStart = req->pos + 1;
+                req->state = S_URI;
+            }
+            else if (c < 'A' || c > 'Z') {
+                req->state = S_ERROR;
+            }
+            break;
+        case S_URI:
+            if (c == ' ') {
+                end_token(req, buf, &req->uri);
+                req->tokenStart = req->pos + 1;
+                req->state = S_VERSION;
+            }
+            else if (c == '\r' || c == '\n' || c == '\0') {
+                req->state = S_ERROR;
+            }
+            break;
+        case S_VERSION:
+            if (c == '\r' || c == '\n') {
+                end_token(req, buf, &req->version);
+                req->state = c == '\r' ? S_LINE_LF : S_HEADER_START;
+            }
+            else if (c == ' ' || c == '\0') {
+                req->state = S_ERROR;
+            }
+            break;
+        case S_LINE_LF:
+            req->state = c == '\n' ? S_HEADER_START : S_ERROR;
+            break;
+        case S_HEADER_START:
+            if (c == '\r') {
+                req->state = S_END_LF;
+                break;
+            }
+            if (c == '\n') {
+                req->state = S_DONE;
+                req->length = req->pos + 1;
+                return PARSE_DONE;
+            }
+            if (req->headers.count == MAX_HEADER_FIELDS || c == ':' || c == ' ' || c == '\t') {
+                req->state = S_ERROR;
+                break;
+            }
+            req->tokenStart = req->pos;
+            req->state = S_HEADER_NAME;
+            break;
+        case S_HEADER_NAME:
+            if (c == ':') {
+                field = &req->headers.fields[req->headers.count];
+                field->name = req->tokenStart;
+                field->nameLength = req->pos - req->tokenStart;
+                buf[req->pos] = '\0';
+                req->state = S_VALUE_START;
+            }
+            else if (c == '\r' || c == '\n' || c == ' ' || c == '\0') {
+                req->state = S_ERROR;
+            }
+            break;
+        case S_VALUE_START:
+            if (c == ' ' || c == '\t') {
+                break;
+            }
+            req->tokenStart = req->pos;
+            req->state = S_VALUE;
+            // Fall through
+        case S_VALUE:
+            if (c == '\r' || c == '\n') {
+                field = &req->headers.fields[req->headers.count++];
+                field->value = req->tokenStart;
+                field->valueLength = req->pos - req->tokenStart;
+                buf[req->pos] = '\0';
+                // Trailing whitespace is not part of the value
+                while (field->valueLength > 0 
+                       && (buf[field->value + field->valueLength - 1] == ' '
+                           || buf[field->value + field->valueLength - 1] == '\t'))
+                {
+                    buf[field->value + --field->valueLength] = '\0';
+                }
+                req->state = c == '\r' ? S_LINE_LF : S_HEADER_START;
+            }
+            else if (c == '\0') {
+                req->state = S_ERROR;
+            }
+            break;
+        case S_END_LF:
+            if (c != '\n') {
+                req->state = S_ERROR;
+                break;
+            }
+            req->state = S_DONE;
+            req->length = req->pos + 1;
+            return PARSE_DONE;
+        case S_DONE:
+            return PARSE_DONE;
+        }
+        if (req->state == S_ERROR) {
+            return PARSE_ERROR;
+        }
+    }
+    if (req->state == S_DONE) {
+        return PARSE_DONE;
+    }
+    return req->state == S_ERROR ? PARSE_ERROR : PARSE_AGAIN;
+}
+
+/**
+ * Returns the value of the first header with the given name, compared without
+ * case, or NULL if the request has none
+ */
+const char *http_request_header(const struct http_request *req, const char *buf, const char *name)
+{
+    int i = header_index_find(&req->headers, buf, name);
+    return i >= 0 ? buf + req->headers.fields[i].value : NULL;
+}
+
+/**
+ * Sets up the decoder for the body of a response, framed as the status code
+ * and header of the response say
+ */
+void body_decoder_init(struct body_decoder *dec, int statusCode, 
+                       const struct header_index *index, const char *headers)
+{
+    char value[32];
+
+    memset(dec, 0, sizeof(struct body_decoder));
+    if (statusCode == 204 || statusCode == 304 || statusCode / 100 == 1) {
+        // Some status code must not have body part
+        dec->framing = BODY_NONE;
+    }
+    else if (header_index_value(index, headers, "Transfer-Encoding", value, sizeof value)
+             && strcasecmp(value, "chunked") == 0)
+    {
+        dec->framing = BODY_CHUNKED;
+        dec->state = C_SIZE;
+    }
+    else if (header_index_value(index, headers, "Content-Length", value, sizeof value)) {
+        dec->framing = BODY_LENGTH;
+        dec->remaining = atoll(value);
+    }
+    else {
+        dec->framing = BODY_UNTIL_CLOSE;
+    }
+    dec->done = dec->framing == BODY_NONE || (dec->framing == BODY_LENGTH && dec->remaining <= 0);
+}
+
+/**
+ * Hands the payload bytes at the start of data to the sink, at most remaining
+ * of them. Returns how many the sink took
+ */
+long pass_to_sink(struct body_decoder *dec, const char *data, size_t len, body_sink sink, void *arg)
+{
+    long taken;
+    if (dec->framing != BODY_UNTIL_CLOSE) {
+        len = min(len, (size_t)dec->remaining);
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if ((taken = sink(arg, data, len)) < 0) {
+        return -1;
+    }
+    if (dec->framing != BODY_UNTIL_CLOSE) {
+        dec->remaining -= taken;
+    }
+    return taken;
+}
+
+/**
+ * Value of a hex digit, or -1 if c is not one
+ */
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Called at the end of a chunk size line. Returns 0, or -1 if it had no size
+ */
+int end_size_line(struct body_decoder *dec)
+{
+    if (dec->digits == 0) {
+        return -1;
+    }
+    dec->digits = 0;
+    // The last chunk has size 0 and is followed by the trailer
+    dec->state = dec->remaining > 0 ? C_DATA : C_TRAILER;
+    return 0;
+}
+
+/**
+ * Decodes the body bytes in data and passes the payload to the sink.
+ * Chunked bodies are decoded one byte at a time by a state machine, so data
+ * can be split anywhere, while chunk payloads go to the sink as whole runs.
+ * Returns how many bytes of data were consumed, which is fewer than len if
+ * the body ended before them or the sink could not take more, or -1 if the
+ * body is malformed or the sink failed
+ */
+long decode_body(struct body_decoder *dec, const char *data, size_t len, body_sink sink, void *arg)
+{
+    size_t pos = 0;
+    long taken;
+    int digit;
+    char c;
+
+    if (dec->framing != BODY_CHUNKED)
+    {
+        if (dec->done) {
+            return 0;
+        }
+        if ((taken = pass_to_sink(dec, data, len, sink, arg)) < 0) {
+            return -1;
+        }
+        dec->done = dec->framing == BODY_LENGTH && dec->remaining == 0;
+        return taken;
+    }
+
+    while (pos < len && !dec->done)
+    {
+        if (dec->state == C_DATA)
+        {
+            if ((taken = pass_to_sink(dec, data + pos, len - pos, sink, arg)) < 0) {
+                return -1;
+            }
+            pos += taken;
+            if (dec->remaining > 0) {
+                // Either data ran out or the sink could not take more for now
+                return pos;
+            }
+            dec->state = C_DATA_CR;
+            continue;
+        }
+
+        c = data[pos++];
+        switch (dec->state)
+        {
+        case C_SIZE:
+            if ((digit = hex_value(c)) >= 0) {
+                if (dec->remaining > (LLONG_MAX >> 4)) {
+                    return -1;
+                }
+                dec->remaining = (dec->remaining << 4) | digit;
+                dec->digits++;
+            }
+            else if (c == ';' || c == ' ' || c == '\t') {
+                dec->state = C_EXT;
+            }
+            else if (c == '\r') {
+                dec->state = C_SIZE_LF;
+            }
+            else if (c != '\n' || end_size_line(dec) < 0) {
+                return -1;
+            }
+            break;
+        case C_EXT:
+            if (c == '\r') {
+                dec->state = C_SIZE_LF;
+            }
+            else if (c == '\n' && end_size_line(dec) < 0) {
+                return -1;
+            }
+            break;
+        case C_SIZE_LF:
+            if (c != '\n' || end_size_line(dec) < 0) {
+                return -1;
+            }
+            break;
+        case C_DATA_CR:
+            if (c == '\r') {
+                dec->state = C_DATA_LF;
+            }
+            else if (c == '\n') {
+                dec->state = C_SIZE;
+            }
+            else {
+                return -1;
+            }
+            break;
+        case C_DATA_LF:
+            if (c != '\n') {
+                return -1;
+            }
+            dec->state = C_SIZE;
+            break;
+        case C_TRAILER:
+            if (c == '\r') {
+                dec->state = C_END_LF;
+            }
+            else if (c == '\n') {
+                dec->done = 1;
+            }
+            else {
+                dec->state = C_TRAILER_LINE;
+            }
+            break;
+        case C_TRAILER_LINE:
+            if (c == '\n') {
+                dec->state = C_TRAILER;
+            }
+            break;
+        case C_END_LF:
+            if (c != '\n') {
+                return -1;
+            }
+            dec->done = 1;
+            break;
+        }
+    }
+    return pos;
+}
+
+/**
+ * Tells the decoder the peer closed the connection.
+ * Returns 0 if that ends the body and -1 if the body is truncated
+ */
+int body_decoder_eof(struct body_decoder *dec)
+{
+    if (dec->framing == BODY_UNTIL_CLOSE) {
+        dec->done = 1;
+    }
+    return dec->done ? 0 : -1;
+}
+
+/**
+ * Inflates a body sent with a gzip or deflate content coding on its way to
+ * the sink of the caller
+ */
+struct content_decoder {
+    z_stream zs;
+    int done;               // End of the compressed stream seen
+    body_sink sink;
+    void *arg;
+    char out[INFLATE_BUFFER_SIZE];
+};
+
+/**
+ * Sets up a content decoder if the response has a coding it can undo.
+ * Returns -1 if the coding is unknown or zlib fails
+ */
+int content_decoder_init(struct http_response *res)
+{
+    char coding[32];
+
+    res->content = NULL;
+    if (!http_response_header(res, "Content-Encoding", coding, sizeof coding) 
+        || strcasecmp(coding, "identity") == 0 || res->body.done) {
+        return 0;
+    }
+    if (strcasecmp(coding, "gzip") != 0 && strcasecmp(coding, "x-gzip") != 0 
+        && strcasecmp(coding, "deflate") != 0) {
+        return -1;
+    }
+    if ((res->content = (struct content_decoder*)calloc(1, sizeof(struct content_decoder))) == NULL) {
+        return -1;
+    }
+    // Detects a gzip or zlib header by itself
+    if (inflateInit2(&res->content->zs, 15 + 32) != Z_OK)
+    {
+        free(res->content);
+        res->content = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Body sink inflating the bytes it is given into the sink of the caller. The
+ * output is handed over in full, so a coded body needs a sink that takes all
+ * it is given. Bytes after the end of the compressed stream are ignored
+ */
+long inflate_to_sink(void *arg, const char *data, size_t len)
+{
+    struct content_decoder *cd = (struct content_decoder*)arg;
+    size_t produced, passed;
+    long taken;
+    int rc;
+
+    cd->zs.next_in = (Bytef*)data;
+    cd->zs.avail_in = len;
+    while (cd->zs.avail_in > 0 && !cd->done)
+    {
+        cd->zs.next_out = (Bytef*)cd->out;
+        cd->zs.avail_out = INFLATE_BUFFER_SIZE;
+        rc = inflate(&cd->zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            cd->done = 1;
+        }
+        else if (rc != Z_OK) {
+            return -1;
+        }
+        produced = INFLATE_BUFFER_SIZE - cd->zs.avail_out;
+        for (passed = 0; passed < produced; passed += taken) {
+            if ((taken = cd->sink(cd->arg, cd->out + passed, produced - passed)) <= 0) {
+                return -1;
+            }
+        }
+    }
+    return len;
+}
+
+/**
+ * Decodes the body bytes in data like decode_body, inflating them first if
+ * the body is coded
+ */
+long decode_content(struct http_response *res, const char *data, size_t len, 
+                    body_sink sink, void *arg)
+{
+    long consumed;
+
+    if (res->content == NULL) {
+        return decode_body(&res->body, data, len, sink, arg);
+    }
+    res->content->sink = sink;
+    res->content->arg = arg;
+    consumed = decode_body(&res->body, data, len, inflate_to_sink, res->content);
+    if (consumed >= 0 && res->body.done && !res->content->done) {
+        // The compressed stream was cut short
+        consumed = -1;
+    }
+    if (consumed < 0 || res->body.done) {
+        http_response_free(res);
+    }
+    return consumed;
+}
+
+/**
+ * Releases what decoding the body of the response holds. Responses given up
+ * on before their body is done must be freed
+ */
+void http_response_free(struct http_response *res)
+{
+    if (res->content != NULL)
+    {
+        inflateEnd(&res->content->zs);
+        free(res->content);
+        res->content = NULL;
+    }
+}
+
+void http_response_init(struct http_response *res)
+{
+    res->headLength = 0;
+    res->headDone = 0;
+    res->statusLength = 0;
+    res->statusCode = 0;
+    res->keepAlive = 0;
+    res->headers.count = 0;
+    memset(&res->body, 0, sizeof(struct body_decoder));
+    res->content = NULL;
+}
+
+/**
+ * Collects the status line and header of the response from data, which may
+ * end anywhere, and sets up the framing of the body once they are complete,
+ * which sets res->headDone. Body bytes are left alone.
+ * Returns how many bytes of data belong to the status line and header, or -1
+ * if they are too large
+ */
+long parse_response_head(struct http_response *res, const char *data, size_t len)
+{
+    int LEN_CRLF = strlen(CRLF);
+    int LEN_CRLFCRLF = strlen(CRLFCRLF);
+    const char *headerEnd, *lineEnd;
+    char connection[32];
+    size_t copied;
+
+    // Only the new bytes and the 3 before them can complete the CRLFCRLF
+    copied = min(len, sizeof res->head - 1 - res->headLength);
+    memcpy(res->head + res->headLength, data, copied);
+    headerEnd = find_header_end(res->head + max(0, res->headLength - LEN_CRLFCRLF + 1), 
+                                res->head + res->headLength + copied);
+    if (headerEnd == NULL) {
+        res->headLength += copied;
+        // Status line and header are too large
+        return res->headLength == sizeof res->head - 1 ? -1 : (long)copied;
+    }
+    copied = headerEnd + LEN_CRLFCRLF - (res->head + res->headLength);
+    res->headLength += copied;
+    res->head[res->headLength] = '\0';
+    res->headDone = 1;
+
+    lineEnd = strstr(res->head, CRLF);
+    res->statusLength = lineEnd - res->head;
+    res->statusCode = get_status_code(res->head);
+    index_headers(lineEnd + LEN_CRLF, headerEnd + LEN_CRLF - (lineEnd + LEN_CRLF), &res->headers);
+    body_decoder_init(&res->body, res->statusCode, &res->headers, lineEnd + LEN_CRLF);
+
+    res->keepAlive = strncmp(res->head, "HTTP/1.1", 8) == 0 
+        && res->body.framing != BODY_UNTIL_CLOSE
+        && !(http_response_header(res, "Connection", connection, sizeof connection)
+             && strcasecmp(connection, "close") == 0);
+    return copied;
+}
+
+/**
+ * Parses the response bytes in data, which may end anywhere. Bytes of the
+ * status line and header are collected in head, body bytes are decoded and
+ * passed to the sink, inflated if the body has a gzip or deflate coding. The response is complete once res->body.done is set.
+ * Returns how many bytes of data were consumed, which is fewer than len if
+ * the response ended before them or the sink could not take more, or -1 if
+ * the response is malformed or the sink failed
+ */
+long parse_http_response(struct http_response *res, const char *data, size_t len, 
+                         body_sink sink, void *arg)
+{
+    long copied, consumed;
+
+    if (res->headDone) {
+        return decode_content(res, data, len, sink, arg);
+    }
+    if ((copied = parse_response_head(res, data, len)) < 0 || !res->headDone) {
+        return copied;
+    }
+    if (content_decoder_init(res) < 0) {
+        return -1;
+    }
+    if ((consumed = decode_content(res, data + copied, len - copied, sink, arg)) < 0) {
+        return -1;
+    }
+    return copied + consumed;
+}
+
+/**
+ * Copies the value of the response header field into buf, like header_index_value
+ */
+int http_response_header(const struct http_response *res, const char *field, char *buf, size_t sz)
+{
+    return header_index_value(&res->headers, res->head + res->statusLength + strlen(CRLF), 
+                              field, buf, sz);
+}
+
+/**
+ * Reads the decimal number at *p and moves *p past it.
+ * Returns 0 if there is no number or it does not fit in an off_t
+ */
+int parse_offset(const char **p, off_t *value)
+{
+    const char *start = *p;
+    *value = 0;
+    for (; **p >= '0' && **p <= '9'; (*p)++) {
+        if (*value > (LLONG_MAX - (**p - '0')) / 10) {
+            return 0;
+        }
+        *value = *value * 10 + (**p - '0');
+    }
+    return *p > start;
+}
+
+/**
+ * Parses the value of a Range header, like "bytes=0-99, 200-, -50", for a
+ * representation of size bytes. Ranges past the end are left out and the
+ * ones running past it are cut short.
+ * Returns the number of ranges stored, 0 if none of them can be satisfied, or
+ * -1 if the value is malformed or has more than max ranges, in which case the
+ * header is ignored
+ */
+int parse_range(const char *value, off_t size, struct byte_range *ranges, int max)
+{
+    const char *p = value;
+    off_t first, last;
+    int count = 0, specs = 0;
+
+    if (strncasecmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+    p += 6;
+    while (1)
+    {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '-')
+        {
+            // Suffix: the last bytes of the representation
+            p++;
+            if (!parse_offset(&p, &last)) {
+                return -1;
+            }
+            first = last < size ? size - last : 0;
+            last = size - 1;
+            if (last < first) {
+                first = size;
+            }
+        }
+        else
+        {
+            if (!parse_offset(&p, &first) || *p++ != '-') {
+                return -1;
+            }
+            if (!parse_offset(&p, &last)) {
+                last = size - 1;
+            }
+            else if (last < first) {
+                return -1;
+            }
+            last = min(last, size - 1);
+        }
+        if (++specs > max) {
+            return -1;
+        }
+        if (first < size) {
+            ranges[count].start = first;
+            ranges[count].end = last + 1;
+            count++;
+        }
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') {
+            return count;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Parses the value of a Content-Range header, like "bytes 0-99/1000". size is
+ * set to -1 if the complete length is unknown.
+ * Returns 0 if the value is malformed
+ */
+int parse_content_range(const char *value, struct byte_range *range, off_t *size)
+{
+    const char *p = value;
+
+    if (strncasecmp(p, "bytes ", 6) != 0) {
+        return 0;
+    }
+    p += 6;
+    if (!parse_offset(&p, &range->start) || *p++ != '-' || !parse_offset(&p, &range->end)
+        || range->end < range->start || *p++ != '/') {
+        return 0;
+    }
+    range->end++;
+    if (*p == '*') {
+        *size = -1;
+        return p[1] == '\0';
+    }
+    return parse_offset(&p, size) && *p == '\0' && *size >= range->end;
+}
+
+/**
+ * Returns whether the value of an If-None-Match header lists the quoted
+ * entity tag or is "*". Weak tags match their strong counterpart, as
+ * conditional GET compares them
+ */
+int etag_matches(const char *ifNoneMatch, const char *etag)
+{
+    const char *p = ifNoneMatch, *end;
+    size_t len;
+
+    if (strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+    }
+    len = strlen(etag);
+    while (1)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') {
+            return 0;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        if (*p != '"' || (end = strchr(p + 1, '"')) == NULL) {
+            return 0;
+        }
+        if ((size_t)(end + 1 - p) == len && strncmp(p, etag, len) == 0) {
+            return 1;
+        }
+        p = end + 1;
+    }
+}
+
+/**
+ * Returns whether the value of an Accept-Encoding header allows the content
+ * coding, named or through "*", with a q-value above 0
+ */
+int accepts_encoding(const char *acceptEncoding, const char *coding)
+{
+    const char *p = acceptEncoding, *name, *q;
+    size_t len = strlen(coding), nameLength;
+    int accepted = 0, named = 0, wildcard = 0;
+
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        nameLength = p - name;
+
+        // Only "q=0" with any number of zeros after the point refuses the coding
+        accepted = 1;
+        for (; *p && *p != ','; p++) {
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                for (q = p + 2; *q == '0' || *q == '.'; q++);
+                accepted = *q >= '1' && *q <= '9';
+            }
+        }
+        if (nameLength == len && strncasecmp(name, coding, len) == 0) {
+            named = 1 + accepted;
+        }
+        else if (nameLength == 1 && *name == '*') {
+            wildcard = 1 + accepted;
+        }
+    }
+    return named ? named == 2 : wildcard == 2;
+}
+
+/**
+ * Turns the path of a request URI into the path of the file to serve, from
+ * the document root: the query is dropped, escapes are decoded, "." and ".."
+ * segments are resolved and repeated slashes collapsed, and a path naming a
+ * directory gets its index.html. Equivalent URIs thus give the same path.
+ * Returns -1 if the path is malformed, leaves the document root or does not
+ * fit in size bytes
+ */
+int normalize_path(const char *uri, char *path, size_t size)
+{
+    const char *p;
+    size_t len = 0, out = 0, in, end;
+    int hi, lo, dir = 1;
+    char c;
+
+    if (*uri != '/') {
+        return -1;
+    }
+    for (p = uri; *p && *p != '?' && *p != '#'; p++)
+    {
+        c = *p;
+        if (c == '%')
+        {
+            if ((hi = hex_value(p[1])) < 0 || (lo = hex_value(p[2])) < 0 || (c = hi * 16 + lo) == '\0') {
+                return -1;
+            }
+            p += 2;
+        }
+        if (len + 1 >= size) {
+            return -1;
+        }
+        path[len++] = c;
+    }
+
+    // Segments are written back in place, each followed by a slash. The
+    // output never catches up with the input, which starts with a slash
+    for (in = 0; in < len; in = end + 1)
+    {
+        for (end = in; end < len && path[end] != '/'; end++);
+        dir = 1;
+        if (end == in || (end - in == 1 && path[in] == '.')) {
+            continue;
+        }
+        if (end - in == 2 && path[in] == '.' && path[in + 1] == '.')
+        {
+            if (out == 0) {
+                return -1;
+            }
+            for (out--; out > 0 && path[out - 1] != '/'; out--);
+            continue;
+        }
+        memmove(path + out, path + in, end - in);
+        out += end - in;
+        path[out++] = '/';
+        dir = end < len;
+    }
+
+    if (!dir) {
+        out--;
+    }
+    else if (out + strlen("index.html") < size) {
+        memcpy(path + out, "index.html", strlen("index.html"));
+        out += strlen("index.html");
+    }
+    else {
+        return -1;
+    }
+    path[out] = '\0';
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <sys/types.h>
+
+#include "utils.h"
+
+// Results of parsing
+#define PARSE_ERROR -1
+#define PARSE_AGAIN 0
+#define PARSE_DONE 1
+
+/**
+ * Part of the buffer being parsed. Slices are NUL-terminated in place once
+ * parsed, so buf + offset can be used as a C string
+ */
+struct http_slice {
+    int offset;
+    int length;
+};
+
+struct http_request {
+    int state;
+    int pos;                // Next byte of the buffer to parse
+    int tokenStart;
+    struct http_slice method, uri, version;
+    struct header_index headers;
+    int length;             // Bytes taken by the request line and header once done
+};
+
+// Framing of a message body
+#define BODY_NONE 0
+#define BODY_LENGTH 1
+#define BODY_CHUNKED 2
+#define BODY_UNTIL_CLOSE 3
+
+/**
+ * Receives the decoded body bytes. Returns how many of them it took, which
+ * may be fewer than len if it cannot take more for now, or -1 on error
+ */
+typedef long (*body_sink)(void *arg, const char *data, size_t len);
+
+struct body_decoder {
+    int framing;
+    int done;
+    long long remaining;    // Bytes left in the body, or in the current chunk
+    int state;              // Chunked bodies only
+    int digits;             // Hex digits of the chunk size seen so far
+};
+
+#define RESPONSE_HEAD_SIZE (STATUS_LINE_SIZE + HEADER_SIZE)
+
+// Header field asking for the content codings parse_http_response can undo
+#define ACCEPT_ENCODING "Accept-Encoding: gzip, deflate\r\n"
+
+struct content_decoder;
+
+/**
+ * Response received in pieces. The status line and header are collected in
+ * head, then the body is decoded straight from the received bytes
+ */
+struct http_response {
+    char head[RESPONSE_HEAD_SIZE];
+    int headLength;
+    int headDone;
+    int statusLength;       // Length of the status line, the header follows its CRLF
+    int statusCode;
+    int keepAlive;          // Whether the connection can take another request
+    struct header_index headers;    // Offsets from the start of the header
+    struct body_decoder body;
+    struct content_decoder *content;    // Inflates a gzip or deflate body, NULL if not coded
+};
+
+// Ranges a request can ask for before the Range header is ignored
+#define MAX_RANGES 16
+
+/**
+ * Bytes [start, end) of a representation
+ */
+struct byte_range {
+    off_t start;
+    off_t end;
+};
+
+void http_request_init(struct http_request *req);
+int parse_http_request(struct http_request *req, char *buf, int len);
+const char *http_request_header(const struct http_request *req, const char *buf, const char *name);
+
+void body_decoder_init(struct body_decoder *dec, int statusCode, 
+                       const struct header_index *index, const char *headers);
+long decode_body(struct body_decoder *dec, const char *data, size_t len, body_sink sink, void *arg);
+int body_decoder_eof(struct body_decoder *dec);
+
+void http_response_init(struct http_response *res);
+long parse_response_head(struct http_response *res, const char *data, size_t len);
+long parse_http_response(struct http_response *res, const char *data, size_t len, 
+                         body_sink sink, void *arg);
+int http_response_header(const struct http_response *res, const char *field, char *buf, size_t sz);
+void http_response_free(struct http_response *res);
+
+int parse_range(const char *value, off_t size, struct byte_range *ranges, int max);
+int parse_content_range(const char *value, struct byte_range *range, off_t *size);
+int etag_matches(const char *ifNoneMatch, const char *etag);
+int accepts_encoding(const char *acceptEncoding, const char *coding);
+int normalize_path(const char *uri, char *path, size_t size);
+
+#endif
@@ -1,32 +1,341 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
+#include "access_log.h"
+#include "file_cache.h"
+#include "handoff.h"
+#include "http_parser.h"
+#include "io_ring.h"
+#include "metrics.h"
+#include "proxy.h"
 #include "utils.h"
+#include "work_queue.h"
 
 #define BUFFER_SIZE (1024 * 4)
 #define NUM_THREADS 10
-#define BACKLOG 20
+#define QUEUE_SIZE 256
+#define BACKLOG 1024
+#define MAX_EVENTS 256
+#define RING_ENTRIES 256
+#define RING_BUFFERS 256
+#define IN_BUFFER_SIZE (REQUEST_LINE_SIZE + HEADER_SIZE)
+// Room for the response head, the range list and a few part heads; a metrics
+// body takes a second block, which the arena keeps for the next requests
+#define ARENA_BLOCK_SIZE (STATUS_LINE_SIZE + HEADER_SIZE + 1024 * 4)
+#define IDLE_TIMEOUT_MS 5000
+#define REQUEST_TIMEOUT_MS 10000        // For the request header, from its first byte
+#define RESPONSE_TIMEOUT_MS 10000       // Before a response must keep up with MIN_SEND_RATE
+#define MIN_SEND_RATE (1024 * 16)       // Bytes per second, on average
+#define MAX_REQUESTS_PER_CONNECTION 100
+#define DRAIN_TIMEOUT_MS 10000          // Given to the requests in flight on shutdown
+#define MAX_DISCARD_SIZE (1024 * 64)    // Unread input thrown away before closing
+#define SPLICE_SIZE (1024 * 64)
+#define BYTERANGES_BOUNDARY "3d6b6a416f9b5c8e"
+
+// States of a connection
+#define CONN_READING 0
+#define CONN_WRITING 1
+#define CONN_PROXYING 2
+
+// Set in the low bit of the connection pointer registered with epoll for the
+// upstream socket of a proxied request
+#define UPSTREAM_EVENT 1
+
+// Operations the io_uring loop queues for a connection, kept in the low bits
+// of the connection pointer given with them. Accepts come with no pointer
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_SPLICE_IN 3
+#define OP_SPLICE_OUT 4
+#define OP_CLOSE 5
+#define OP_MASK 7
+
+// user_data of the io_uring operations of no connection, below the alignment
+// of connections
+#define ACCEPT_DATA 0
+#define WAKE_DATA 1
+#define CANCEL_DATA 2
+
+#define REPRESENTATION_IDENTITY 0
+#define REPRESENTATION_GZIP_VARIANT 1
+#define REPRESENTATION_GZIP_FILE 2
+
+struct connection {
+    int sockfd;
+    int state;
+    int keepAlive;
+    int requestsServed;
+    long long lastActive;
+    struct connection *prev, *next;     // Event loop list, least recently active first
+
+    // Shard and access log ring of the thread serving the connection, and
+    // the times in microseconds they are measured from
+    struct metrics_shard *metrics;
+    struct access_log *log;
+    char client[INET6_ADDRSTRLEN];
+    int loopback;                       // Connected from this host, which may scrape /metrics
+    long long acceptedAt;
+    long long requestStart;             // First byte of the current request, 0 before it
+    long long responseStart;
+    int firstByteSent;
+    int statusCode;
+    long long responseBytes;
+
+    // Bytes received but not yet consumed. The request is parsed in place and
+    // pipelined requests wait here until the response to the request before
+    // them is sent
+    char in[IN_BUFFER_SIZE];
+    int inLength;
+    struct http_request req;
+    int parseResult;
+
+    // Response is sent as a list of buffers in memory, followed by the body
+    // streamed from a file by the kernel if it is not cached. A cached
+    // response starts with the prebuilt header of its entry and only the end
+    // of the header is built for the request. Buffers built for the response
+    // come from the arena, which is reset once it is sent
+    struct arena arena;
+    char *head;
+    int headLength;
+    struct cache_entry *entry;
+    const struct mime_type *mimeType;   // Of the file, also when a precompressed one is sent
+    const char *data;                   // Body sent from the entry, plain or gzipped
+    struct iovec iov[3];
+    int iovCount;
+    int iovIndex;
+    int fileFd;
+    off_t fileOffset;
+    off_t fileEnd;
+
+    // Parts of a multipart/byteranges body, sent one after the other once the
+    // head is. Part i is partHeads[i] followed by ranges[i], the last part
+    // head closes the body
+    struct byte_range *ranges;
+    struct iovec *partHeads;
+    int partCount;
+    int partIndex;
+
+    // Pipe the file goes through when it cannot be sent with sendfile, and
+    // always in the io_uring loop, which has no sendfile
+    int pipefd[2];
+    int pipeLength;
+
+    // Operations of the io_uring loop in flight for the connection. It is
+    // only freed once they have all completed
+    int pending;
+    int failed;
+    int closing;
+    struct msghdr msg;
+
+    // Exchange with an upstream for proxied requests, kept for the next ones.
+    // A connection closed by the epoll loop is only freed after the batch of
+    // events, which may still hold events of its upstream socket
+    struct proxy_exchange *proxy;
+    int closed;
+};
+
+struct event_loop {
+    int epfd;
+    struct io_ring *ring;               // Instead of epfd in the io_uring loop
+    int listenfd;
+    struct connection *head, *tail;
+    struct connection *closed;          // Waiting to be freed, linked by next
+    struct metrics_shard *metrics;
+    struct access_log *log;
+    struct upstream_pool pool;
+    int draining;                       // No longer accepting
+    long long drainDeadline;
+};
+
+struct worker {
+    int id;
+    int listenfd;
+    pthread_t thread;
+};
+
+int threaded = 0;
+int uring = 0;
+int numThreads = NUM_THREADS;
+int queueSize = QUEUE_SIZE;
+int numWorkers = 0;
+int proxyBalance = BALANCE_ROUND_ROBIN;
+int publicMetrics = 0;
+const char *accessLogPath = NULL;
+int accessLogFd = STDOUT_FILENO;
+int preload = 0;
+const char *handoffPath = NULL;
+char docRoot[PATH_MAX];
+
+// Listening sockets, one per worker, which a new server can take over
+int listenFds[MAX_LISTENERS];
+int listenCount = 0;
+
+// Set once the server drains, which every thread checks. A byte written to
+// the pipe wakes the event loops up, which watch it
+int stopping = 0;
+int wakeFds[2] = { -1, -1 };
+// Connections queued or served by the pool of -t
+int activeConnections = 0;
 
 void print_usage() 
 {
-    eprintf("usage: http_server port_number\n");
+    eprintf("usage: http_server [-t [-n threads] [-q connections]] [-u] [-w workers] [-l file] [-P]\n"
+            "                   [-p prefix=host:port[,host:port...]]... [-L] [-H path] [-M] port_number\n");
+    eprintf("\t-t serves the connections from a pool of -n threads (10) instead of the\n");
+    eprintf("\t   event loop, queuing up to -q of them (256) and rejecting the rest with 503\n");
+    eprintf("\t-u runs the event loops on io_uring instead of epoll\n");
+    eprintf("\t-w starts the given number of event loops, each pinned to a core\n");
+    eprintf("\t   and accepting on its own SO_REUSEPORT socket\n");
+    eprintf("\t-l appends the access log to the file instead of stdout\n");
+    eprintf("\t-P loads the files under the current directory into the cache at startup\n");
+    eprintf("\t-p forwards the requests whose path starts with prefix to the upstream\n");
+    eprintf("\t   servers, in turn; the longest matching prefix wins\n");
+    eprintf("\t-L forwards to the upstream with the fewest requests in flight instead\n");
+    eprintf("\t-M serves /metrics to every client, not only to those on this host\n");
+    eprintf("\t-H takes the listening sockets over from the server started with the same\n");
+    eprintf("\t   -H, if any, which then drains, and listens on the Unix socket at path to\n");
+    eprintf("\t   hand them over to the next one\n");
+    eprintf("\tSIGTERM and SIGINT drain the server, SIGHUP reloads the document root\n");
+    eprintf("\tand reopens the access log\n");
 }
 
-void sigterm_handler(int signum)
+/**
+ * Makes the server drain: the event loops stop accepting, finish the
+ * requests in flight without keeping their connections alive and return once
+ * none is left, or after DRAIN_TIMEOUT_MS
+ */
+void begin_stop()
 {
-    printf("Server stopped!\n");
-    exit(1);
+    if (__atomic_exchange_n(&stopping, 1, __ATOMIC_ACQ_REL) == 0 && write(wakeFds[1], "x", 1) < 0) {
+        perror("server: write");
+    }
+}
+
+int is_stopping()
+{
+    return __atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
+
+/**
+ * Enters the document root again, which picks up a directory swapped in
+ * under its path, drops the cached files and reopens the access log, which
+ * may have been rotated. Requests in flight keep the files they opened
+ */
+void reload()
+{
+    int fd;
+
+    if (chdir(docRoot) < 0) {
+        perror("server: chdir");
+    }
+    file_cache_flush();
+    if (preload) {
+        printf("server: preloaded %zu files\n", file_cache_preload("."));
+    }
+    // The flusher keeps writing to the same descriptor, now the new file
+    if (accessLogPath != NULL)
+    {
+        if ((fd = open(accessLogPath, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+            perror("server: open");
+        }
+        else {
+            dup2(fd, accessLogFd);
+            close(fd);
+        }
+    }
+    printf("server: reloaded\n");
+    fflush(stdout);
+}
+
+/**
+ * Waits for the signals, which every other thread blocks. Handling them here
+ * rather than in a handler leaves no restriction on what they can do: a first
+ * SIGTERM or SIGINT drains the server, a second one stops it right away
+ */
+void* run_signals(void *argument)
+{
+    sigset_t *signals = (sigset_t*)argument;
+    int signum;
+
+    while (sigwait(signals, &signum) == 0)
+    {
+        if (signum == SIGHUP) {
+            reload();
+        }
+        else if (!is_stopping()) {
+            printf("server: draining\n");
+            fflush(stdout);
+            begin_stop();
+        }
+        else {
+            printf("Server stopped!\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Waits for a new server to connect to the handoff socket and sends it the
+ * listening sockets. Both accept from them until the new server is ready and
+ * says so, then this one drains. The sockets stay open throughout, so no
+ * connection is refused during a restart, and a new server that fails to
+ * start leaves this one serving
+ */
+void* run_handoff(void *argument)
+{
+    int sockfd = (int)(long)argument, fd;
+    char ready;
+
+    while (!is_stopping())
+    {
+        if ((fd = accept(sockfd, NULL, NULL)) < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("server: handoff accept");
+                break;
+            }
+            continue;
+        }
+        if (handoff_send(fd, listenFds, listenCount) < 0) {
+            perror("server: handoff");
+        }
+        else if (read(fd, &ready, 1) != 1) {
+            eprintf("server: the new server did not start, still serving\n");
+        }
+        else {
+            printf("server: handed over %d listening sockets, draining\n", listenCount);
+            fflush(stdout);
+            begin_stop();
+        }
+        close(fd);
+    }
+    close(sockfd);
+    return NULL;
 }
 
-int open_socket_and_listen(const char *portNumber)
+int open_socket_and_listen(const char *portNumber, int reusePort)
 {
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
@@ -54,6 +363,11 @@ int open_socket_and_listen(const char *portNumber)
             return -1;
         }
 
+        if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0) {
+            perror("setsockopt");
+            return -1;
+        }
+
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) < 0) {
             close(sockfd);
             perror("server: bind");
@@ -73,73 +387,215 @@ int open_socket_and_listen(const char *portNumber)
     return sockfd;
 }
 
-int recv_http_request(int sockfd, char **request, char **header)
+int set_nonblocking(int sockfd)
+{
+    int flags;
+    if ((flags = fcntl(sockfd, F_GETFL, 0)) < 0) {
+        return -1;
+    }
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Whether the address is a loopback one, IPv4 also when mapped to IPv6
+ */
+int is_loopback(const struct sockaddr_storage *addr)
 {
-    int LEN_CRLF = strlen(CRLF);
-    int totalBytesRcvd = 0, bytesRcvd;
-    char buffer[BUFFER_SIZE];
-    char *pch;
+    const struct in6_addr *a6;
 
-    int filling = 0;            // 0: status ; 1: header;
-    
-    *request = (char*)malloc(max(REQUEST_LINE_SIZE, BUFFER_SIZE));
-    *header  = (char*)malloc(max(HEADER_SIZE, BUFFER_SIZE));
+    if (addr->ss_family == AF_INET) {
+        return (ntohl(((const struct sockaddr_in*)addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr->ss_family == AF_INET6)
+    {
+        a6 = &((const struct sockaddr_in6*)addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a6) || (IN6_IS_ADDR_V4MAPPED(a6) && a6->s6_addr[12] == 127);
+    }
+    return 0;
+}
 
-    *request[0] = *header[0] = '\0';
+struct connection *new_connection(int sockfd, struct sockaddr_storage *addr, 
+                                  struct metrics_shard *metrics, struct access_log *log)
+{
+    struct connection *conn = (struct connection*)calloc(1, sizeof(struct connection));
+    conn->sockfd = sockfd;
+    conn->state = CONN_READING;
+    conn->lastActive = now_ms();
+    inet_ntop(addr->ss_family, get_in_addr((struct sockaddr*)addr), conn->client, sizeof conn->client);
+    conn->loopback = is_loopback(addr);
+    conn->metrics = metrics;
+    conn->log = log;
+    conn->acceptedAt = now_us();
+    METRIC_ADD(metrics->accepted, 1);
+    http_request_init(&conn->req);
+    conn->fileFd = conn->pipefd[0] = conn->pipefd[1] = -1;
+    arena_init(&conn->arena, ARENA_BLOCK_SIZE);
+    return conn;
+}
 
-    while (1)
+void free_connection(struct connection *conn)
+{
+    char discard[1024];
+    size_t discarded = 0;
+    ssize_t n;
+
+    // Closing a socket with unread input resets the connection, and the reset
+    // can destroy responses the client has not read yet. Pipelined requests
+    // that will not be answered are read and thrown away first, up to
+    // MAX_DISCARD_SIZE so a client sending without end cannot hold the loop.
+    // The io_uring loop may have closed the socket already
+    if (conn->sockfd >= 0)
     {
-        bytesRcvd = recv(sockfd, buffer, BUFFER_SIZE - 1, 0);
-        buffer[bytesRcvd] = '\0';
+        shutdown(conn->sockfd, SHUT_WR);
+        while (discarded < MAX_DISCARD_SIZE
+               && (n = recv(conn->sockfd, discard, sizeof discard, MSG_DONTWAIT)) > 0) {
+            discarded += n;
+        }
+        close(conn->sockfd);
+    }
+    arena_free(&conn->arena);
+    if (conn->entry != NULL) {
+        file_cache_release(conn->entry);
+    }
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    if (conn->proxy != NULL) {
+        proxy_exchange_free(conn->proxy);
+    }
+    METRIC_ADD(conn->metrics->closed, 1);
+    free(conn);
+}
 
-        if (bytesRcvd <= 0) {
-            if (bytesRcvd < 0) {
-                totalBytesRcvd = bytesRcvd;
-            }
-            break;
+/**
+ * Drops the request that was just answered and its response, moving any
+ * pipelined bytes after it to the front of the input buffer
+ */
+void reset_connection(struct connection *conn)
+{
+    conn->inLength -= conn->req.length;
+    memmove(conn->in, conn->in + conn->req.length, conn->inLength);
+    http_request_init(&conn->req);
+
+    arena_reset(&conn->arena);
+    conn->head = NULL;
+    conn->headLength = 0;
+    conn->iovCount = conn->iovIndex = 0;
+    conn->ranges = NULL;
+    conn->partHeads = NULL;
+    conn->partCount = conn->partIndex = 0;
+    if (conn->entry != NULL) {
+        file_cache_release(conn->entry);
+        conn->entry = NULL;
+    }
+    conn->data = NULL;
+    conn->fileFd = -1;
+    conn->fileOffset = conn->fileEnd = 0;
+    conn->state = CONN_READING;
+    conn->requestStart = conn->inLength > 0 ? now_us() : 0;
+    conn->responseBytes = 0;
+}
+
+/**
+ * Parses the request from the bytes received so far. Returns 1 once the
+ * header is complete or known to be malformed and 0 if more bytes are needed
+ */
+int parse_received(struct connection *conn)
+{
+    if ((conn->parseResult = parse_http_request(&conn->req, conn->in, conn->inLength)) != PARSE_AGAIN)
+    {
+        if (conn->requestStart != 0) {
+            metrics_record(&conn->metrics->parse, now_us() - conn->requestStart);
         }
-        totalBytesRcvd += bytesRcvd;
-        
-        if (filling == 0)     // Filling status line buffer
-        {
-            strcat(*request, buffer);
+        return 1;
+    }
+    if (conn->inLength == IN_BUFFER_SIZE) {
+        // Request line and header are too large
+        conn->parseResult = PARSE_ERROR;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Whether the connection has taken too long over its request header or its
+ * response, however often it makes progress: a client sending or reading a
+ * byte now and then keeps pushing the idle timeout back, but not this.
+ * Proxied exchanges depend on the upstream and are not limited
+ */
+int too_slow(struct connection *conn)
+{
+    long long elapsed, delivered;
+    int queued;
+
+    if (conn->state == CONN_READING) {
+        return conn->requestStart != 0 && now_us() - conn->requestStart > REQUEST_TIMEOUT_MS * 1000LL;
+    }
+    if (conn->state == CONN_WRITING)
+    {
+        if ((elapsed = now_us() - conn->responseStart) <= RESPONSE_TIMEOUT_MS * 1000LL) {
+            return 0;
         }
-        else if (filling == 1) // Filling header buffer
-        {
-            strcat(*header, buffer);
+        // Bytes still queued in the socket have not reached the client
+        delivered = conn->responseBytes;
+        if (ioctl(conn->sockfd, SIOCOUTQ, &queued) == 0) {
+            delivered = max(delivered - queued, 0);
         }
+        return elapsed > RESPONSE_TIMEOUT_MS * 1000LL + delivered * 1000000LL / MIN_SEND_RATE;
+    }
+    return 0;
+}
 
-        if (filling == 0)
-        {
-            // If CRLF is found on status line, cut it off from there and move
-            // the cuf-off part to the header buffer
-            if ((pch = strstr(*request, CRLF)) != NULL)
-            {
-                pch[0] = '\0';
-                strcat(*header, pch + LEN_CRLF);           
+/**
+ * Accounts for n bytes received at the end of the input buffer
+ */
+void add_received(struct connection *conn, int n)
+{
+    conn->inLength += n;
+    conn->lastActive = now_ms();
+    if (conn->requestStart == 0) {
+        conn->requestStart = now_us();
+    }
+}
 
-                // Finished with filling status line, move on to header
-                filling = 1;                 
-            }
+/**
+ * Receives as much of the request line and header as the socket has available.
+ * Can be called again with the same connection to resume where it left off.
+ * Returns 1 once the header is complete or known to be malformed, 0 if the
+ * socket would block before that and -1 if an error occured or the peer
+ * closed the connection
+ */
+int recv_http_request(struct connection *conn)
+{
+    int bytesRcvd;
+
+    while (!parse_received(conn))
+    {
+        bytesRcvd = recv(conn->sockfd, conn->in + conn->inLength,
+                         IN_BUFFER_SIZE - conn->inLength, 0);
+        if (bytesRcvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
         }
-        if (filling == 1)
-        {
-            // If 2 consecutive CRLFs are found in header section, cut if off at between
-            // the 2 CRLFs and move the cut-off (without any CRLF) to the body buffer
-            if ((pch = strstr(*header, CRLFCRLF)) != NULL)
-            {
-                pch[LEN_CRLF] = '\0';
-                break;
-            }
+        if (bytesRcvd <= 0) {
+            return -1;
+        }
+        add_received(conn, bytesRcvd);
+        if (too_slow(conn)) {
+            return -1;
         }
     }
-    return totalBytesRcvd;
+    return 1;
 }
 
 void get_status_line(int statusCode, char *status, int sz)
 {
     char format[] = "HTTP/1.1 %d %s\r\n";
-    if (statusCode == 405)
+    if (statusCode == 400)
+    {
+        snprintf(status, sz, format, statusCode, "Bad Request");
+    }
+    else if (statusCode == 405)
     {
         snprintf(status, sz, format, statusCode, "Method Not Allowed");
     }
@@ -155,164 +611,2118 @@ void get_status_line(int statusCode, char *status, int sz)
     {
         snprintf(status, sz, format, statusCode, "Not Found");
     }
+    else if (statusCode == 206)
+    {
+        snprintf(status, sz, format, statusCode, "Partial Content");
+    }
+    else if (statusCode == 416)
+    {
+        snprintf(status, sz, format, statusCode, "Range Not Satisfiable");
+    }
+    else if (statusCode == 304)
+    {
+        snprintf(status, sz, format, statusCode, "Not Modified");
+    }
+    else if (statusCode == 411)
+    {
+        snprintf(status, sz, format, statusCode, "Length Required");
+    }
+    else if (statusCode == 431)
+    {
+        snprintf(status, sz, format, statusCode, "Request Header Fields Too Large");
+    }
+    else if (statusCode == 502)
+    {
+        snprintf(status, sz, format, statusCode, "Bad Gateway");
+    }
+    else if (statusCode == 503)
+    {
+        snprintf(status, sz, format, statusCode, "Service Unavailable");
+    }
 }
 
-int send_http_response(int sockfd, const char *request, const char *reqHeader)
+/**
+ * Writes the header fields and sets the body of a partial response. A single
+ * range is sent alone and several as a multipart body, whose part heads are
+ * built up front to know the length of the body. Either way the ranges come
+ * straight from the cached data or the file.
+ * Returns the length of the body
+ */
+off_t add_ranges(struct connection *conn, struct byte_range *ranges, int count, off_t fileSize)
 {
-    char method[5], uri[URI_SIZE], httpVersion[16];
-    char buffer[BUFFER_SIZE], resHeader[HEADER_SIZE];
-    
-    char *body = NULL;
-    int bodyLength = 0;
-    int statusCode;
-    int bytesRead;
-    int bytesSent, totalBytesSent = 0;
-    char status[STATUS_LINE_SIZE];
-    FILE *file;
-    
-    resHeader[0] = '\0';
+    off_t contentLength = 0;
+    int i;
 
-    // This is unsafe but I'm lazy
-    sscanf(request, "%s %s %s", method, uri, httpVersion);
-    if (strcmp("GET", method) != 0)
-    {
-        statusCode = 405;
-    }
-    else if (strcmp("HTTP/1.1", httpVersion) != 0)
+    if (count == 1)
     {
-        statusCode = 505;
-    }
-    else {
-        if (strcmp(uri, "/") == 0) {
-            strcpy(uri, "/index.html");
-        }
-        file = fopen(uri + 1, "rb");
-        if (file) {
-            body = (char*)malloc(BODY_SIZE);
-            do {
-                bytesRead = fread(buffer, 1, BUFFER_SIZE, file);
-                memcpy(body + bodyLength, buffer, bytesRead);
-                bodyLength += bytesRead;
-            } while (bytesRead >= BUFFER_SIZE);
-            fclose(file);
-            statusCode = 200;
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE,
+                                     "Content-Range: bytes %lld-%lld/%lld\r\n",
+                                     (long long)ranges[0].start, (long long)ranges[0].end - 1,
+                                     (long long)fileSize);
+        if (conn->data != NULL) {
+            conn->iov[1].iov_base = (char*)conn->data + ranges[0].start;
+            conn->iov[1].iov_len = ranges[0].end - ranges[0].start;
         }
         else {
-            statusCode = 404;
+            conn->fileOffset = ranges[0].start;
+            conn->fileEnd = ranges[0].end;
         }
+        return ranges[0].end - ranges[0].start;
     }
 
-    // Send status line
-    get_status_line(statusCode, status, STATUS_LINE_SIZE);
-    if ((bytesSent = send(sockfd, status, strlen(status), 0)) < 0)
+    conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE,
+                                 "Content-Type: multipart/byteranges; boundary=%s\r\n", 
+                                 BYTERANGES_BOUNDARY);
+    conn->ranges = ranges;
+    conn->partHeads = (struct iovec*)arena_alloc(&conn->arena, (count + 1) * sizeof(struct iovec));
+    conn->partCount = count + 1;
+    for (i = 0; i <= count; i++)
     {
-        free(body);
-        return -1;
+        // The last part head only closes the body
+        conn->partHeads[i].iov_base = arena_alloc(&conn->arena, BUFFER_SIZE);
+        if (i < count) {
+            conn->partHeads[i].iov_len = snprintf((char*)conn->partHeads[i].iov_base, BUFFER_SIZE, 
+                                                  "\r\n--%s\r\nContent-Type: %s\r\n"
+                                                  "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                                                  BYTERANGES_BOUNDARY, conn->mimeType->name,
+                                                  (long long)ranges[i].start, (long long)ranges[i].end - 1,
+                                                  (long long)fileSize);
+            contentLength += ranges[i].end - ranges[i].start;
+        }
+        else {
+            conn->partHeads[i].iov_len = snprintf((char*)conn->partHeads[i].iov_base, BUFFER_SIZE, 
+                                                  "\r\n--%s--\r\n", BYTERANGES_BOUNDARY);
+        }
+        contentLength += conn->partHeads[i].iov_len;
     }
-    totalBytesSent += bytesSent;
-    
-    // Send header
-    if (body != NULL) {
-        snprintf(resHeader + strlen(resHeader), HEADER_SIZE, 
-                 "Content-Length: %d\r\n", bodyLength);
-       
+    // Parts are sent once the head is
+    conn->fileOffset = conn->fileEnd = 0;
+    return contentLength;
+}
+
+/**
+ * Lets go of the file of a response that turns out to have no body
+ */
+void drop_file(struct connection *conn)
+{
+    if (conn->entry != NULL) {
+        file_cache_release(conn->entry);
+        conn->entry = NULL;
     }
+    conn->data = NULL;
+    conn->fileFd = -1;
+    conn->fileEnd = 0;
+}
 
-    strcat(resHeader, "\r\n");
+/**
+ * Returns whether the client already has the version of the file, going by
+ * If-None-Match, or by If-Modified-Since when there is no If-None-Match
+ */
+int not_modified(struct connection *conn, const struct file_validators *v)
+{
+    const char *ifNoneMatch = http_request_header(&conn->req, conn->in, "If-None-Match");
+    const char *ifModifiedSince = http_request_header(&conn->req, conn->in, "If-Modified-Since");
+    time_t since;
 
-    if ((bytesSent = send(sockfd, resHeader, strlen(resHeader), 0)) < 0)
-    {
-        free(body);
-        return -1;
+    if (ifNoneMatch != NULL) {
+        return etag_matches(ifNoneMatch, v->etag);
     }
-    totalBytesSent += bytesSent;
+    return ifModifiedSince != NULL && (since = parse_http_date(ifModifiedSince)) >= 0 
+        && v->mtime <= since;
+}
 
-    // Send body
-    if ((bytesSent = send(sockfd, body, bodyLength, 0)) < 0)
-    {
-        free(body);
-        return -1;
+/**
+ * Returns whether the ranges asked for can be sent, which If-Range only
+ * allows if the client has the current version of the file. A weak or date
+ * validator is only trusted if it matches exactly
+ */
+int if_range_matches(struct connection *conn, const struct file_validators *v)
+{
+    const char *ifRange = http_request_header(&conn->req, conn->in, "If-Range");
+
+    if (ifRange == NULL) {
+        return 1;
     }
-    totalBytesSent += bytesSent;
-    free(body);
-    return totalBytesSent;
+    if (ifRange[0] == '"') {
+        return strcmp(ifRange, v->etag) == 0;
+    }
+    return strcmp(ifRange, v->lastModified) == 0;
 }
 
-sem_t sem;
-
-void* handle_connection(void *argument)
+/**
+ * Opens the representation of the file to send. A client accepting gzip gets
+ * the variant compressed when the file was cached or, for the files too large
+ * to be held in memory, a precompressed "<path>.gz" next to the file if there
+ * is one. The body comes from conn->data, or from conn->fileFd if it is NULL;
+ * either belongs to the cache entry.
+ * Returns REPRESENTATION_*, or -1 if there is no such file
+ */
+int open_representation(struct connection *conn, const char *path, int gzip,
+                        off_t *size, struct file_validators *v)
 {
-    int* sockfdPtr = (int*)argument;
-    int sockfd = *sockfdPtr;
-    int bytesRcvd;
-    char *request = NULL;
-    char *header = NULL;
+    char gzipPath[PATH_MAX];
+    struct cache_entry *entry, *gzipEntry;
 
-    if ((bytesRcvd = recv_http_request(sockfd, &request, &header)) < 0)
+    if ((entry = conn->entry = file_cache_get(path)) == NULL) {
+        return -1;
+    }
+    *size = entry->length;
+    *v = entry->validators;
+    conn->mimeType = entry->mimeType;
+    if (entry->data != NULL)
     {
-        eprintf("server: error occured while receiving http request\n");
+        if (gzip && entry->gzipData != NULL)
+        {
+            conn->data = entry->gzipData;
+            *size = entry->gzipLength;
+            strcpy(v->etag, entry->gzipEtag);
+            return REPRESENTATION_GZIP_VARIANT;
+        }
+        conn->data = entry->data;
+        return REPRESENTATION_IDENTITY;
     }
-    else {
-        printf("server: got request - %s\n", request);
-        send_http_response(sockfd, request, header);
+
+    if (gzip && (size_t)snprintf(gzipPath, PATH_MAX, "%s.gz", path) < PATH_MAX
+        && (gzipEntry = file_cache_get(gzipPath)) != NULL)
+    {
+        file_cache_release(entry);
+        conn->entry = gzipEntry;
+        *size = gzipEntry->length;
+        *v = gzipEntry->validators;
+        conn->data = gzipEntry->data;
+        conn->fileFd = gzipEntry->fd;
+        return REPRESENTATION_GZIP_FILE;
     }
-   
-    free(request);
-    free(header);
-    free(sockfdPtr);
-    close(sockfd);
-    sem_post(&sem);
-    return NULL;
+    conn->data = NULL;
+    conn->fileFd = entry->fd;
+    return REPRESENTATION_IDENTITY;
 }
 
-int main(int argc, char *argv[])
+/**
+ * Answers a scrape of the metrics endpoint with the totals of every thread
+ */
+void build_metrics_response(struct connection *conn)
 {
-    pthread_t thread;
+    char *body = (char*)arena_alloc(&conn->arena, METRICS_SIZE);
+    size_t length = metrics_render(body, METRICS_SIZE);
+
+    get_status_line(200, conn->head, STATUS_LINE_SIZE);
+    conn->headLength = strlen(conn->head);
+    conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE,
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Cache-Control: no-store\r\n"
+                                 "Content-Length: %zu\r\n%s\r\n",
+                                 length, conn->keepAlive ? "" : "Connection: close\r\n");
+    conn->iov[0].iov_base = conn->head;
+    conn->iov[0].iov_len = conn->headLength;
+    conn->iov[1].iov_base = body;
+    conn->iov[1].iov_len = length;
+    conn->iovCount = 2;
+    conn->statusCode = 200;
+    metrics_count_status(conn->metrics, 200);
+}
+
+/**
+ * Builds the status line, header and body answering the request of the connection
+ */
+void build_http_response(struct connection *conn)
+{
+    const char *method = conn->in + conn->req.method.offset;
+    const char *uri = conn->in + conn->req.uri.offset;
+    const char *httpVersion = conn->in + conn->req.version.offset;
+    const char *connection = http_request_header(&conn->req, conn->in, "Connection");
+    char path[PATH_MAX];
+    const char *range = http_request_header(&conn->req, conn->in, "Range");
+    const char *acceptEncoding = http_request_header(&conn->req, conn->in, "Accept-Encoding");
     
-    int sockfd;
-    int *newfd;
-    struct sockaddr_storage clientAddr;    
-    socklen_t sin_size;
-    struct sigaction sa;
-    char s[INET6_ADDRSTRLEN];
+    int statusCode, rangeCount = -1, compressible = 0, representation = REPRESENTATION_IDENTITY;
+    off_t fileSize = 0, contentLength = 0;
+    struct byte_range *ranges = NULL;
+    struct file_validators validators;
 
-    if (argc != 2) {
-        print_usage();
-        return 1;
+    conn->head = (char*)arena_alloc(&conn->arena, STATUS_LINE_SIZE + HEADER_SIZE);
+    conn->responseStart = now_us();
+
+    // HTTP/1.1 connections persist unless either side asks to close them.
+    // Requests other than GET may carry a body we do not read, so the
+    // connection is closed after answering them
+    conn->requestsServed++;
+    conn->keepAlive = conn->parseResult == PARSE_DONE 
+        && strcmp("HTTP/1.1", httpVersion) == 0 
+        && strcmp("GET", method) == 0
+        && conn->requestsServed < MAX_REQUESTS_PER_CONNECTION
+        && !is_stopping();
+    if (connection != NULL && strcasecmp(connection, "close") == 0)
+    {
+        conn->keepAlive = 0;
     }
 
-    if ((sockfd = open_socket_and_listen(argv[1])) < 0)
+    if (conn->parseResult == PARSE_ERROR)
     {
-        return 1;
+        statusCode = 400;
+    }
+    else if (strcmp("GET", method) != 0)
+    {
+        statusCode = 405;
+    }
+    else if (strcmp("HTTP/1.1", httpVersion) != 0)
+    {
+        statusCode = 505;
+    }
+    // Other clients get the file of that name, if any
+    else if (strcmp(uri, METRICS_PATH) == 0 && (conn->loopback || publicMetrics))
+    {
+        build_metrics_response(conn);
+        return;
+    }
+    else if (normalize_path(uri, path, sizeof path) < 0)
+    {
+        statusCode = 400;
+    }
+    else {
+        // Files too large to be held in memory are kept open and sent from
+        // there by the kernel
+        compressible = file_compressible(path);
+        representation = open_representation(conn, path, compressible && acceptEncoding != NULL 
+                                             && accepts_encoding(acceptEncoding, "gzip"),
+                                             &fileSize, &validators);
+        metrics_record(&conn->metrics->fileOpen, now_us() - conn->responseStart);
+        if (representation < 0) {
+            statusCode = 404;
+        }
+        else {
+            conn->fileOffset = 0;
+            conn->fileEnd = conn->data == NULL ? fileSize : 0;
+            statusCode = 200;
+        }
     }
 
-    sa.sa_handler = sigterm_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGTERM, &sa, NULL) == -1) {
-        perror("sigaction");
-        exit(1);
+    if (statusCode == 200 && not_modified(conn, &validators))
+    {
+        statusCode = 304;
+        drop_file(conn);
     }
 
-    printf("server: waiting for connection...\n");
-    sem_init(&sem, 0, NUM_THREADS);
-    while (1) {
-        sin_size = sizeof clientAddr;
-        newfd = (int*)malloc(sizeof(int));
-        *newfd = accept(sockfd, (struct sockaddr *)&clientAddr, &sin_size);
-        if (newfd < 0) {
-            perror("accept");
-            continue;
+    // A Range header that cannot be parsed is ignored and the whole file sent
+    if (statusCode == 200 && range != NULL && if_range_matches(conn, &validators))
+    {
+        ranges = (struct byte_range*)arena_alloc(&conn->arena, MAX_RANGES * sizeof(struct byte_range));
+        if ((rangeCount = parse_range(range, fileSize, ranges, MAX_RANGES)) == 0) 
+        {
+            statusCode = 416;
+            drop_file(conn);
+        }
+        else if (rangeCount > 0) {
+            statusCode = 206;
+        }
+    }
+
+    conn->statusCode = statusCode;
+    metrics_count_status(conn->metrics, statusCode);
+    if (conn->entry != NULL && statusCode == 200 && representation != REPRESENTATION_GZIP_FILE)
+    {
+        if (!conn->keepAlive) {
+            conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE - conn->headLength,
+                                         "Connection: close\r\n");
         }
+        strcpy(conn->head + conn->headLength, CRLF);
+        conn->headLength += strlen(CRLF);
 
-        sem_wait(&sem);
-        inet_ntop(clientAddr.ss_family,
-            get_in_addr((struct sockaddr *)&clientAddr),
-            s, sizeof s);
-        printf("server: got connection from %s\n", s);
-        
-        pthread_create(&thread, NULL, handle_connection, newfd);
+        if (representation == REPRESENTATION_GZIP_VARIANT) {
+            conn->iov[0].iov_base = conn->entry->gzipHead;
+            conn->iov[0].iov_len = conn->entry->gzipHeadLength;
+        }
+        else {
+            conn->iov[0].iov_base = conn->entry->head;
+            conn->iov[0].iov_len = conn->entry->headLength;
+        }
+        conn->iov[1].iov_base = conn->head;
+        conn->iov[1].iov_len = conn->headLength;
+        conn->iov[2].iov_base = (char*)conn->data;
+        conn->iov[2].iov_len = fileSize;
+        conn->iovCount = conn->data != NULL ? 3 : 2;
+        return;
     }
-    close(sockfd);
-    return 0;
-}
+
+    // Status line
+    get_status_line(statusCode, conn->head, STATUS_LINE_SIZE);
+    conn->headLength = strlen(conn->head);
+    
+    // Header
+    conn->iov[1].iov_len = 0;
+    if (statusCode == 200 || statusCode == 206 || statusCode == 304)
+    {
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE, 
+                                     "ETag: %s\r\nLast-Modified: %s\r\n", 
+                                     validators.etag, validators.lastModified);
+        if (compressible) {
+            conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE,
+                                         "Vary: Accept-Encoding\r\n");
+        }
+    }
+    // Multipart bodies give the type of each part instead
+    if (statusCode == 200 || (statusCode == 206 && rangeCount == 1))
+    {
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE, 
+                                     "Content-Type: %s\r\n", conn->mimeType->name);
+    }
+    if ((statusCode == 200 || statusCode == 206) && representation != REPRESENTATION_IDENTITY)
+    {
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE, 
+                                     "Content-Encoding: gzip\r\n");
+    }
+    if (statusCode == 200)
+    {
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE, 
+                                     "Accept-Ranges: bytes\r\n");
+        contentLength = fileSize;
+        if (conn->data != NULL) {
+            conn->iov[1].iov_base = (char*)conn->data;
+            conn->iov[1].iov_len = fileSize;
+        }
+    }
+    else if (statusCode == 206)
+    {
+        contentLength = add_ranges(conn, ranges, rangeCount, fileSize);
+    }
+    else if (statusCode == 416)
+    {
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE,
+                                     "Content-Range: bytes */%lld\r\n", (long long)fileSize);
+    }
+    if (statusCode != 304) {
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE, 
+                                     "Content-Length: %lld\r\n", (long long)contentLength);
+    }
+    if (!conn->keepAlive) {
+        conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE, 
+                                     "Connection: close\r\n");
+    }
+    strcpy(conn->head + conn->headLength, CRLF);
+    conn->headLength += strlen(CRLF);
+
+    conn->iov[0].iov_base = conn->head;
+    conn->iov[0].iov_len = conn->headLength;
+    conn->iovCount = conn->iov[1].iov_len > 0 ? 2 : 1;
+}
+
+/**
+ * Answers with an empty response of the status, for requests that go no further
+ */
+void build_status_response(struct connection *conn, int statusCode)
+{
+    conn->head = (char*)arena_alloc(&conn->arena, STATUS_LINE_SIZE + HEADER_SIZE);
+    get_status_line(statusCode, conn->head, STATUS_LINE_SIZE);
+    conn->headLength = strlen(conn->head);
+    conn->headLength += snprintf(conn->head + conn->headLength, HEADER_SIZE, "Content-Length: 0\r\n%s\r\n",
+                                 conn->keepAlive ? "" : "Connection: close\r\n");
+    conn->iov[0].iov_base = conn->head;
+    conn->iov[0].iov_len = conn->headLength;
+    conn->iovCount = 1;
+    conn->statusCode = statusCode;
+    metrics_count_status(conn->metrics, statusCode);
+}
+
+/**
+ * Accounts for n bytes of the response sent
+ */
+void add_sent(struct connection *conn, ssize_t n)
+{
+    conn->lastActive = now_ms();
+    METRIC_ADD(conn->metrics->bytesSent, n);
+    conn->responseBytes += n;
+    if (!conn->firstByteSent)
+    {
+        conn->firstByteSent = 1;
+        metrics_record(&conn->metrics->firstByte, now_us() - conn->acceptedAt);
+    }
+}
+
+/**
+ * Moves the file to the socket through a pipe with splice, for the files
+ * sendfile cannot handle. Returns like send_file
+ */
+int splice_file(struct connection *conn)
+{
+    ssize_t n;
+    loff_t offset;
+
+    if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_NONBLOCK) < 0) {
+        return -1;
+    }
+    while (conn->fileOffset < conn->fileEnd || conn->pipeLength > 0)
+    {
+        if (conn->pipeLength == 0)
+        {
+            offset = conn->fileOffset;
+            n = splice(conn->fileFd, &offset, conn->pipefd[1], NULL,
+                       min(SPLICE_SIZE, conn->fileEnd - conn->fileOffset), 
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n <= 0) {
+                // The file shrank or cannot be spliced either
+                return -1;
+            }
+            conn->fileOffset = offset;
+            conn->pipeLength = n;
+        }
+        n = splice(conn->pipefd[0], NULL, conn->sockfd, NULL, conn->pipeLength,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK 
+                   | (conn->fileOffset < conn->fileEnd ? SPLICE_F_MORE : 0));
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        conn->pipeLength -= n;
+        add_sent(conn, n);
+        if (too_slow(conn)) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Sends the rest of the file body without copying it through user space.
+ * Returns 1 once the whole file is sent, 0 if the socket would block before
+ * that and -1 on error
+ */
+int send_file(struct connection *conn)
+{
+    ssize_t n;
+
+    // A previous call fell back to splice and may have bytes left in the pipe
+    if (conn->pipeLength > 0) {
+        return splice_file(conn);
+    }
+    while (conn->fileOffset < conn->fileEnd)
+    {
+        n = sendfile(conn->sockfd, conn->fileFd, &conn->fileOffset, 
+                     conn->fileEnd - conn->fileOffset);
+        if (n < 0)
+        {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                return splice_file(conn);
+            }
+            return -1;
+        }
+        if (n == 0) {
+            // The file shrank since it was opened
+            return -1;
+        }
+        add_sent(conn, n);
+        if (too_slow(conn)) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Skips the n bytes of the buffers that were sent
+ */
+void advance_buffers(struct connection *conn, size_t n)
+{
+    while (conn->iovIndex < conn->iovCount && n >= conn->iov[conn->iovIndex].iov_len) {
+        n -= conn->iov[conn->iovIndex].iov_len;
+        conn->iovIndex++;
+    }
+    if (n > 0) {
+        conn->iov[conn->iovIndex].iov_base = (char*)conn->iov[conn->iovIndex].iov_base + n;
+        conn->iov[conn->iovIndex].iov_len -= n;
+    }
+}
+
+/**
+ * Returns whether the file or more parts follow the buffers in memory, in
+ * which case the last segment of the buffers waits to be filled up by them
+ * instead of leaving on its own
+ */
+int more_follows(struct connection *conn)
+{
+    return (conn->fileFd >= 0 && conn->fileOffset < conn->fileEnd) || conn->partIndex < conn->partCount;
+}
+
+/**
+ * Sends the buffers of the response in memory, as many at once as the socket
+ * accepts. Returns like send_file
+ */
+int send_buffers(struct connection *conn)
+{
+    struct msghdr msg;
+    int flags = MSG_NOSIGNAL | (more_follows(conn) ? MSG_MORE : 0);
+    ssize_t n;
+
+    memset(&msg, 0, sizeof msg);
+    while (conn->iovIndex < conn->iovCount)
+    {
+        msg.msg_iov = conn->iov + conn->iovIndex;
+        msg.msg_iovlen = conn->iovCount - conn->iovIndex;
+        if ((n = sendmsg(conn->sockfd, &msg, flags)) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        add_sent(conn, n);
+        advance_buffers(conn, n);
+        if (too_slow(conn)) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Moves on to the next part of a multipart body
+ */
+void next_part(struct connection *conn)
+{
+    int i = conn->partIndex++;
+
+    conn->iov[0] = conn->partHeads[i];
+    conn->iovCount = 1;
+    conn->iovIndex = 0;
+    if (i == conn->partCount - 1) {
+        return;
+    }
+    if (conn->data != NULL)
+    {
+        conn->iov[1].iov_base = (char*)conn->data + conn->ranges[i].start;
+        conn->iov[1].iov_len = conn->ranges[i].end - conn->ranges[i].start;
+        conn->iovCount = 2;
+    }
+    else {
+        conn->fileOffset = conn->ranges[i].start;
+        conn->fileEnd = conn->ranges[i].end;
+    }
+}
+
+/**
+ * Writes the record of the answered request to the access log of the thread,
+ * unless the log is behind and drops it
+ */
+void log_request(struct connection *conn, long long now)
+{
+    struct access_record *r = access_log_reserve(conn->log, conn->statusCode);
+
+    if (r == NULL) {
+        return;
+    }
+    r->time = time(NULL);
+    memcpy(r->client, conn->client, sizeof r->client);
+    if (conn->parseResult == PARSE_DONE)
+    {
+        access_log_copy(r->method, conn->in + conn->req.method.offset, LOG_METHOD_SIZE);
+        access_log_copy(r->path, conn->in + conn->req.uri.offset, LOG_PATH_SIZE);
+    }
+    else {
+        strcpy(r->method, "-");
+        strcpy(r->path, "-");
+    }
+    r->status = conn->statusCode;
+    r->bytes = conn->responseBytes;
+    r->durationUs = now - (conn->requestStart != 0 ? conn->requestStart : conn->responseStart);
+    access_log_commit(conn->log);
+}
+
+/**
+ * Measures and logs the response once it is sent
+ */
+void finish_response(struct connection *conn)
+{
+    long long now = now_us();
+
+    metrics_record(&conn->metrics->send, now - conn->responseStart);
+    log_request(conn, now);
+}
+
+/**
+ * Starts forwarding the request to an upstream if a route matches its path.
+ * A request that cannot be forwarded is answered with the status the
+ * exchange failed with. Returns 0 if the request is not proxied
+ */
+int start_proxy(struct event_loop *loop, struct connection *conn)
+{
+    const char *httpVersion = conn->in + conn->req.version.offset;
+    const char *connection = http_request_header(&conn->req, conn->in, "Connection");
+    struct route *route;
+
+    if (conn->parseResult != PARSE_DONE
+        || (strcmp("HTTP/1.1", httpVersion) != 0 && strcmp("HTTP/1.0", httpVersion) != 0)
+        || (route = proxy_find_route(conn->in + conn->req.uri.offset)) == NULL) {
+        return 0;
+    }
+    if (conn->proxy == NULL) {
+        conn->proxy = proxy_exchange_new(conn->sockfd, loop->epfd, (char*)conn + UPSTREAM_EVENT, &loop->pool);
+    }
+    conn->responseStart = now_us();
+
+    // Unlike for files, any method goes and its body is forwarded
+    conn->requestsServed++;
+    conn->keepAlive = strcmp("HTTP/1.1", httpVersion) == 0
+        && conn->requestsServed < MAX_REQUESTS_PER_CONNECTION
+        && !is_stopping()
+        && !(connection != NULL && strcasecmp(connection, "close") == 0);
+
+    if (proxy_start(conn->proxy, route, proxyBalance, conn->in, &conn->req, conn->inLength,
+                    conn->client, conn->keepAlive) < 0)
+    {
+        // The body, if any, is left unread
+        conn->keepAlive = 0;
+        build_status_response(conn, conn->proxy->statusCode);
+        conn->state = CONN_WRITING;
+        return 1;
+    }
+    // The body bytes received with the head are the exchange's now
+    conn->req.length += conn->proxy->bodyLength;
+    conn->state = CONN_PROXYING;
+    return 1;
+}
+
+/**
+ * Moves the exchange of the connection on. Once it is done the response is
+ * accounted for like any other; if it fails before the response head is
+ * sent, the client is answered with the status it failed with instead.
+ * Returns 1 once the request is answered or being answered, 0 if a socket
+ * would block and -1 if the connection must be closed
+ */
+int step_proxy(struct connection *conn)
+{
+    struct proxy_exchange *x = conn->proxy;
+    long long sent = x->sent;
+    int rv;
+
+    // Silence from the upstream counts towards the idle timeout of the client
+    conn->lastActive = now_ms();
+    rv = proxy_step(x);
+    if (x->sent > sent) {
+        add_sent(conn, x->sent - sent);
+    }
+    if (rv == 0) {
+        return 0;
+    }
+    if (rv < 0)
+    {
+        if (x->state >= X_SEND_HEAD) {
+            return -1;
+        }
+        conn->keepAlive = 0;
+        build_status_response(conn, x->statusCode);
+        conn->state = CONN_WRITING;
+        return 1;
+    }
+    conn->statusCode = x->statusCode;
+    metrics_count_status(conn->metrics, x->statusCode);
+    finish_response(conn);
+    conn->keepAlive = conn->keepAlive && x->keepAlive;
+    if (!conn->keepAlive) {
+        return -1;
+    }
+    reset_connection(conn);
+    return 1;
+}
+
+/**
+ * Sends as much of the response as the socket accepts, building it first if
+ * this is the first call for the current request.
+ * Returns 1 once the whole response is sent, 0 if the socket would block
+ * before that and -1 on error
+ */
+int send_http_response(struct connection *conn)
+{
+    int rv;
+
+    if (conn->head == NULL) {
+        build_http_response(conn);
+    }
+    while (1)
+    {
+        if ((rv = send_buffers(conn)) != 1) {
+            return rv;
+        }
+        if (conn->fileFd >= 0 && (rv = send_file(conn)) != 1) {
+            return rv;
+        }
+        if (conn->partIndex == conn->partCount)
+        {
+            finish_response(conn);
+            return 1;
+        }
+        next_part(conn);
+    }
+}
+
+/**
+ * Serves the requests of a blocking connection until it is closed
+ */
+void handle_connection(struct connection *conn)
+{
+    struct timeval timeout = { IDLE_TIMEOUT_MS / 1000, (IDLE_TIMEOUT_MS % 1000) * 1000 };
+
+    // Idle keep-alive connections, and clients that stop reading the
+    // response, give their thread back after the timeout. A send that times
+    // out fails like one that would block, and the response is cut short.
+    // Clients trickling their request or reading a byte now and then are
+    // stopped by too_slow
+    setsockopt(conn->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(conn->sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+    do {
+        if (recv_http_request(conn) <= 0) {
+            break;
+        }
+        conn->state = CONN_WRITING;
+        if (send_http_response(conn) <= 0) {
+            break;
+        }
+        reset_connection(conn);
+    } while (conn->keepAlive);
+   
+    free_connection(conn);
+}
+
+/**
+ * Answers the connection with 503 right away and closes it, when there is
+ * no room to queue it. The request is not read
+ */
+void reject_connection(struct connection *conn)
+{
+    const char *response = "HTTP/1.1 503 Service Unavailable\r\n"
+                           "Retry-After: 1\r\n"
+                           "Content-Length: 0\r\n"
+                           "Connection: close\r\n\r\n";
+    ssize_t n;
+
+    conn->responseStart = now_us();
+    conn->statusCode = 503;
+    metrics_count_status(conn->metrics, 503);
+    if ((n = send(conn->sockfd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
+    {
+        METRIC_ADD(conn->metrics->bytesSent, n);
+        conn->responseBytes = n;
+    }
+    log_request(conn, now_us());
+    free_connection(conn);
+}
+
+/**
+ * Thread of the pool, serving the queued connections one after the other
+ */
+void* run_pool_thread(void *argument)
+{
+    struct work_queue *queue = (struct work_queue*)argument;
+    struct metrics_shard *metrics = metrics_acquire();
+    struct access_log *log = access_log_acquire();
+    struct connection *conn;
+
+    while (1)
+    {
+        conn = (struct connection*)work_queue_pop(queue);
+        conn->metrics = metrics;
+        conn->log = log;
+        handle_connection(conn);
+        __atomic_fetch_sub(&activeConnections, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * Moves the connection to the end of the list of the event loop, which is
+ * kept ordered from the least to the most recently active
+ */
+void touch_connection(struct event_loop *loop, struct connection *conn)
+{
+    if (loop->tail == conn) {
+        return;
+    }
+    // Unlink
+    if (conn->prev) conn->prev->next = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    if (loop->head == conn) loop->head = conn->next;
+    // Append
+    conn->prev = loop->tail;
+    conn->next = NULL;
+    if (loop->tail) loop->tail->next = conn;
+    loop->tail = conn;
+    if (loop->head == NULL) loop->head = conn;
+}
+
+void close_connection(struct event_loop *loop, struct connection *conn)
+{
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->head = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    else loop->tail = conn->prev;
+    if (loop->ring == NULL)
+    {
+        conn->closed = 1;
+        conn->next = loop->closed;
+        loop->closed = conn;
+        return;
+    }
+    if (conn->pending > 0)
+    {
+        // The io_uring loop frees it once the operations in flight complete,
+        // which shutting the socket down hurries along
+        conn->closing = 1;
+        shutdown(conn->sockfd, SHUT_RDWR);
+        return;
+    }
+    free_connection(conn);
+}
+
+/**
+ * Frees the connections the epoll loop closed. Closing their sockets also
+ * removes them from the epoll set
+ */
+void free_closed_connections(struct event_loop *loop)
+{
+    struct connection *conn;
+
+    while ((conn = loop->closed) != NULL)
+    {
+        loop->closed = conn->next;
+        free_connection(conn);
+    }
+}
+
+/**
+ * Advances the connection through its states as far as its socket allows,
+ * answering pipelined requests one after the other.
+ * Returns 1 when the connection is finished and should be closed
+ */
+int drive_connection(struct event_loop *loop, struct connection *conn)
+{
+    int rv;
+
+    while (1)
+    {
+        if (conn->state == CONN_READING)
+        {
+            if ((rv = recv_http_request(conn)) == 0) {
+                return 0;
+            }
+            if (rv < 0) {
+                return 1;
+            }
+            if (!start_proxy(loop, conn)) {
+                conn->state = CONN_WRITING;
+            }
+        }
+        if (conn->state == CONN_PROXYING)
+        {
+            if ((rv = step_proxy(conn)) == 0) {
+                return 0;
+            }
+            if (rv < 0) {
+                return 1;
+            }
+            continue;
+        }
+        if (conn->state == CONN_WRITING)
+        {
+            if ((rv = send_http_response(conn)) == 0) {
+                return 0;
+            }
+            if (rv < 0 || !conn->keepAlive) {
+                return 1;
+            }
+            reset_connection(conn);
+        }
+    }
+}
+
+/**
+ * Closes the connections that have been inactive for longer than the idle
+ * timeout and returns how long until the next one expires, or until the
+ * drain deadline if sooner. Connections too slow with their request or
+ * response are closed when they next make progress, or from here once they
+ * are the least recently active
+ */
+int expire_connections(struct event_loop *loop)
+{
+    long long now = now_ms();
+    int timeout = -1;
+
+    while (loop->head != NULL && (now - loop->head->lastActive >= IDLE_TIMEOUT_MS || too_slow(loop->head))) {
+        close_connection(loop, loop->head);
+    }
+    if (loop->head != NULL) {
+        timeout = (int)(loop->head->lastActive + IDLE_TIMEOUT_MS - now);
+    }
+    if (loop->draining && (timeout < 0 || loop->drainDeadline - now < timeout)) {
+        timeout = (int)max(loop->drainDeadline - now, 0);
+    }
+    return timeout;
+}
+
+/**
+ * Whether the connection waits for a request it has received nothing of
+ */
+int is_idle(struct connection *conn)
+{
+    return conn->state == CONN_READING && conn->inLength == 0;
+}
+
+/**
+ * Closes the idle connections of the event loop, which has stopped
+ * accepting. The others are closed once their response is sent, or at the
+ * drain deadline
+ */
+void start_drain(struct event_loop *loop)
+{
+    struct connection *conn, *next;
+
+    loop->draining = 1;
+    loop->drainDeadline = now_ms() + DRAIN_TIMEOUT_MS;
+    for (conn = loop->head; conn != NULL; conn = next)
+    {
+        next = conn->next;
+        if (is_idle(conn)) {
+            close_connection(loop, conn);
+        }
+    }
+}
+
+/**
+ * Whether the draining event loop is done, either because its last
+ * connection is closed or because the deadline has passed
+ */
+int drained(struct event_loop *loop)
+{
+    return loop->draining && (loop->head == NULL || now_ms() >= loop->drainDeadline);
+}
+
+/**
+ * Accepts every pending connection on the non-blocking listening socket and
+ * registers them with the epoll instance
+ */
+void accept_connections(struct event_loop *loop)
+{
+    int newfd;
+    struct sockaddr_storage clientAddr;    
+    socklen_t sin_size;
+    struct epoll_event ev;
+    struct connection *conn;
+
+    while (1)
+    {
+        sin_size = sizeof clientAddr;
+        if ((newfd = accept(loop->listenfd, (struct sockaddr *)&clientAddr, &sin_size)) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        if (set_nonblocking(newfd) < 0) {
+            perror("fcntl");
+            close(newfd);
+            continue;
+        }
+        conn = new_connection(newfd, &clientAddr, loop->metrics, loop->log);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, newfd, &ev) < 0) {
+            perror("epoll_ctl");
+            free_connection(conn);
+            continue;
+        }
+        touch_connection(loop, conn);
+    }
+}
+
+/**
+ * Serves every connection from a single edge-triggered epoll loop until the
+ * server drains. The listening socket is registered with a NULL pointer, the
+ * wake-up pipe with wakeFds, and the connections with a pointer to their state
+ */
+int run_event_loop(int listenfd)
+{
+    int n, i, timeout;
+    struct event_loop loop;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct connection *conn;
+
+    memset(&loop, 0, sizeof loop);
+    loop.listenfd = listenfd;
+    loop.metrics = metrics_acquire();
+    loop.log = access_log_acquire();
+    if ((loop.epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    if (set_nonblocking(listenfd) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    // Level-triggered, so every event loop sees the byte nobody reads
+    ev.events = EPOLLIN;
+    ev.data.ptr = wakeFds;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, wakeFds[0], &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    while (!drained(&loop))
+    {
+        timeout = expire_connections(&loop);
+        free_closed_connections(&loop);
+        if ((n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout)) < 0)
+        {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(&loop);
+                continue;
+            }
+            if (events[i].data.ptr == wakeFds)
+            {
+                // Connections still queued on the listening socket are left
+                // to the server it was handed over to, if any
+                epoll_ctl(loop.epfd, EPOLL_CTL_DEL, listenfd, NULL);
+                epoll_ctl(loop.epfd, EPOLL_CTL_DEL, wakeFds[0], NULL);
+                start_drain(&loop);
+                continue;
+            }
+            // Errors on the upstream socket are left to the exchange to find
+            conn = (struct connection*)((unsigned long)events[i].data.ptr & ~(unsigned long)UPSTREAM_EVENT);
+            if (conn->closed) {
+                continue;
+            }
+            if (((events[i].events & EPOLLERR) && conn == events[i].data.ptr) || drive_connection(&loop, conn)
+                || (loop.draining && is_idle(conn))) {
+                close_connection(&loop, conn);
+            }
+            else {
+                touch_connection(&loop, conn);
+            }
+        }
+    }
+    while (loop.head != NULL) {
+        close_connection(&loop, loop.head);
+    }
+    free_closed_connections(&loop);
+    close(loop.epfd);
+    return loop.draining ? 0 : -1;
+}
+
+/**
+ * Queues an operation of the connection on fd, to be filled in by the caller.
+ * Returns NULL if the ring is broken
+ */
+struct io_uring_sqe *queue_op(struct event_loop *loop, struct connection *conn, int op, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = io_ring_sqe(loop->ring)) == NULL) {
+        return NULL;
+    }
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long long)(unsigned long)conn | op;
+    conn->pending++;
+    return sqe;
+}
+
+/**
+ * Queues a receive into whichever buffer of the ring the kernel picks once
+ * bytes arrive, so idle connections hold no buffer. Returns -1 on error
+ */
+int queue_recv(struct event_loop *loop, struct connection *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = queue_op(loop, conn, OP_RECV, conn->sockfd)) == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->len = IN_BUFFER_SIZE - conn->inLength;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IO_RING_BUFFER_GROUP;
+    return 0;
+}
+
+/**
+ * Returns whether the connection can be closed as soon as the response is
+ * sent. Like free_connection, it must not be while the client may still be
+ * sending: a request other than GET may carry a body we do not read, and
+ * pipelined requests may follow
+ */
+int can_close_after_send(struct connection *conn)
+{
+    return !conn->keepAlive && conn->fileFd < 0 && conn->partIndex == conn->partCount
+        && conn->parseResult == PARSE_DONE && strcmp(conn->in + conn->req.method.offset, "GET") == 0
+        && conn->inLength == conn->req.length;
+}
+
+/**
+ * Queues the send of the buffers of the response in memory. When they end
+ * the connection, the close is linked behind the send so both take a single
+ * submission. Returns -1 on error
+ */
+int queue_send(struct event_loop *loop, struct connection *conn)
+{
+    struct io_uring_sqe *sqe;
+    int closeAfter = can_close_after_send(conn);
+
+    if (closeAfter && io_ring_reserve(loop->ring, 2) < 0) {
+        return -1;
+    }
+    if ((sqe = queue_op(loop, conn, OP_SEND, conn->sockfd)) == NULL) {
+        return -1;
+    }
+    conn->msg.msg_iov = conn->iov + conn->iovIndex;
+    conn->msg.msg_iovlen = conn->iovCount - conn->iovIndex;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (unsigned long)&conn->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | (more_follows(conn) ? MSG_MORE : 0);
+    if (!closeAfter) {
+        return 0;
+    }
+    // The kernel retries a short send until it is whole, and cancels the
+    // close if it cannot be
+    sqe->msg_flags |= MSG_WAITALL;
+    sqe->flags |= IOSQE_IO_LINK;
+    if ((sqe = queue_op(loop, conn, OP_CLOSE, conn->sockfd)) == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    return 0;
+}
+
+/**
+ * Queues the next chunk of the file: spliced into the pipe and, linked
+ * behind it, out of the pipe to the socket. A short splice into the pipe
+ * cancels the one out of it, and what did reach the pipe is sent on its own.
+ * Returns -1 on error
+ */
+int queue_splice(struct event_loop *loop, struct connection *conn)
+{
+    struct io_uring_sqe *sqe;
+    unsigned len = conn->pipeLength;
+    int more = conn->fileOffset < conn->fileEnd;
+
+    if (conn->pipefd[0] < 0 && pipe(conn->pipefd) < 0) {
+        return -1;
+    }
+    if (conn->pipeLength == 0)
+    {
+        len = min(SPLICE_SIZE, conn->fileEnd - conn->fileOffset);
+        more = conn->fileOffset + len < conn->fileEnd;
+        if (io_ring_reserve(loop->ring, 2) < 0
+            || (sqe = queue_op(loop, conn, OP_SPLICE_IN, conn->pipefd[1])) == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = conn->fileFd;
+        sqe->splice_off_in = conn->fileOffset;
+        sqe->off = -1;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    if ((sqe = queue_op(loop, conn, OP_SPLICE_OUT, conn->sockfd)) == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = conn->pipefd[0];
+    sqe->splice_off_in = -1;
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+    return 0;
+}
+
+/**
+ * Advances the connection through its states as far as it goes without
+ * waiting, like drive_connection, then queues the operation it waits for.
+ * Returns 1 when the connection is finished and should be closed
+ */
+int drive_uring_connection(struct event_loop *loop, struct connection *conn)
+{
+    while (1)
+    {
+        if (conn->state == CONN_READING)
+        {
+            if (!parse_received(conn)) {
+                return queue_recv(loop, conn) < 0;
+            }
+            conn->state = CONN_WRITING;
+            build_http_response(conn);
+        }
+        if (conn->iovIndex < conn->iovCount) {
+            return queue_send(loop, conn) < 0;
+        }
+        if (conn->fileFd >= 0 && (conn->fileOffset < conn->fileEnd || conn->pipeLength > 0)) {
+            return queue_splice(loop, conn) < 0;
+        }
+        if (conn->partIndex < conn->partCount)
+        {
+            next_part(conn);
+            continue;
+        }
+        finish_response(conn);
+        // The socket is already closed if the close was linked to the send
+        if (!conn->keepAlive || conn->sockfd < 0) {
+            return 1;
+        }
+        reset_connection(conn);
+    }
+}
+
+/**
+ * Applies the result of an operation of the connection and, once none is in
+ * flight any more, drives it on
+ */
+void complete_operation(struct event_loop *loop, struct io_uring_cqe *cqe)
+{
+    struct connection *conn = (struct connection*)(unsigned long)(cqe->user_data & ~(unsigned long long)OP_MASK);
+    int op = cqe->user_data & OP_MASK;
+    int res = cqe->res;
+    char *buffer;
+
+    conn->pending--;
+    if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        buffer = io_ring_buffer(loop->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (res > 0) {
+            memcpy(conn->in + conn->inLength, buffer, res);
+            add_received(conn, res);
+        }
+        io_ring_recycle(loop->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (op == OP_RECV) {
+        // Out of buffers, the receive is queued again
+        conn->failed |= res <= 0 && res != -ENOBUFS;
+    }
+    else if (op == OP_SEND && res > 0)
+    {
+        add_sent(conn, res);
+        advance_buffers(conn, res);
+    }
+    else if (op == OP_SPLICE_IN && res > 0)
+    {
+        conn->fileOffset += res;
+        conn->pipeLength += res;
+    }
+    else if (op == OP_SPLICE_OUT && res >= 0)
+    {
+        conn->pipeLength -= res;
+        add_sent(conn, res);
+    }
+    else if (op == OP_CLOSE && res == 0) {
+        conn->sockfd = -1;
+    }
+    else if (op != OP_SPLICE_OUT || res != -ECANCELED) {
+        conn->failed = 1;
+    }
+    conn->failed |= too_slow(conn);
+
+    if (conn->pending > 0) {
+        return;
+    }
+    if (conn->closing) {
+        free_connection(conn);
+    }
+    else if (conn->failed || drive_uring_connection(loop, conn) || (loop->draining && is_idle(conn))) {
+        close_connection(loop, conn);
+    }
+    else {
+        touch_connection(loop, conn);
+    }
+}
+
+/**
+ * Arms the multishot accept on the listening socket, which keeps completing
+ * with a new connection until the kernel stops it. Returns -1 on error
+ */
+int queue_accept(struct event_loop *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = io_ring_sqe(loop->ring)) == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ACCEPT_DATA;
+    return 0;
+}
+
+/**
+ * Queues a poll of the wake-up pipe, which completes once the server drains.
+ * Returns -1 if the ring is broken
+ */
+int queue_wake(struct event_loop *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = io_ring_sqe(loop->ring)) == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wakeFds[0];
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = WAKE_DATA;
+    return 0;
+}
+
+/**
+ * Cancels the multishot accept and drains the connections. Returns -1 if
+ * the ring is broken
+ */
+int complete_wake(struct event_loop *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = io_ring_sqe(loop->ring)) == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ACCEPT_DATA;
+    sqe->user_data = CANCEL_DATA;
+    start_drain(loop);
+    return 0;
+}
+
+/**
+ * Sets up the connection accepted by the completion and starts reading its
+ * first request
+ */
+void complete_accept(struct event_loop *loop, struct io_uring_cqe *cqe)
+{
+    struct sockaddr_storage clientAddr;
+    socklen_t sin_size = sizeof clientAddr;
+    struct connection *conn;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !loop->draining && queue_accept(loop) < 0) {
+        eprintf("server: could not accept again\n");
+    }
+    if (cqe->res < 0)
+    {
+        if (cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) {
+            eprintf("accept: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+    // A multishot accept has nowhere to put the address of each client
+    if (getpeername(cqe->res, (struct sockaddr*)&clientAddr, &sin_size) < 0)
+    {
+        close(cqe->res);
+        return;
+    }
+    conn = new_connection(cqe->res, &clientAddr, loop->metrics, loop->log);
+    touch_connection(loop, conn);
+    if (drive_uring_connection(loop, conn)) {
+        close_connection(loop, conn);
+    }
+}
+
+/**
+ * Serves every connection from an io_uring instance instead of epoll. The
+ * connections go through the same states as in run_event_loop, but the
+ * kernel performs the I/O: each turn of the loop submits every operation
+ * queued during the last one and waits for their completions with a single
+ * system call. Accepts come from one multishot accept and receives take
+ * their buffer from a ring shared with the kernel. A poll of the wake-up
+ * pipe tells the loop to drain
+ */
+int run_uring_loop(int listenfd)
+{
+    struct event_loop loop;
+    struct io_ring ring;
+    struct io_uring_cqe *next, cqe;
+    int timeout;
+
+    memset(&loop, 0, sizeof loop);
+    loop.listenfd = listenfd;
+    loop.ring = &ring;
+    loop.metrics = metrics_acquire();
+    loop.log = access_log_acquire();
+    if (io_ring_init(&ring, RING_ENTRIES) < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (io_ring_add_buffers(&ring, RING_BUFFERS, BUFFER_SIZE) < 0 || queue_accept(&loop) < 0
+        || queue_wake(&loop) < 0) {
+        perror("io_uring_register");
+        io_ring_free(&ring);
+        return -1;
+    }
+
+    while (!drained(&loop))
+    {
+        timeout = expire_connections(&loop);
+        if (io_ring_submit(&ring, timeout) < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        while ((next = io_ring_peek(&ring)) != NULL)
+        {
+            cqe = *next;
+            io_ring_seen(&ring);
+            if (cqe.user_data == ACCEPT_DATA) {
+                complete_accept(&loop, &cqe);
+            }
+            else if (cqe.user_data == WAKE_DATA) {
+                if (complete_wake(&loop) < 0) {
+                    eprintf("server: could not stop accepting\n");
+                }
+            }
+            else if (cqe.user_data != CANCEL_DATA) {
+                complete_operation(&loop, &cqe);
+            }
+        }
+    }
+    // Connections with operations in flight are left to the exit
+    while (loop.head != NULL) {
+        close_connection(&loop, loop.head);
+    }
+    io_ring_free(&ring);
+    return loop.draining ? 0 : -1;
+}
+
+/**
+ * Runs the event loop chosen on the command line, epoll or io_uring
+ */
+int run_loop(int listenfd)
+{
+    return uring ? run_uring_loop(listenfd) : run_event_loop(listenfd);
+}
+
+/**
+ * Starts a fixed pool of threads serving blocking connections, then accepts
+ * connections and queues them for the pool. The accept loop never waits for
+ * the pool: connections that find the queue full are turned away with 503.
+ * Once the server drains, it waits for the pool to finish the queued
+ * connections until DRAIN_TIMEOUT_MS
+ */
+int run_threaded(int sockfd)
+{
+    pthread_t thread;
+    int newfd, i;
+    long long deadline;
+    struct pollfd fds[2] = { { sockfd, POLLIN, 0 }, { wakeFds[0], POLLIN, 0 } };
+    struct timespec interval = { 0, 10 * 1000000L };
+    struct sockaddr_storage clientAddr;    
+    socklen_t sin_size;
+    struct connection *conn;
+    struct work_queue queue;
+    // The accept loop counts the connections and logs the ones it rejects
+    struct metrics_shard *metrics = metrics_acquire();
+    struct access_log *log = access_log_acquire();
+
+    if (work_queue_init(&queue, queueSize) < 0) {
+        perror("work_queue_init");
+        return -1;
+    }
+    for (i = 0; i < numThreads; i++)
+    {
+        if (pthread_create(&thread, NULL, run_pool_thread, &queue) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    // Another server shares the socket during a handoff and may take the
+    // connection first, so accept must not block
+    if (set_nonblocking(sockfd) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    while (1) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        sin_size = sizeof clientAddr;
+        newfd = accept(sockfd, (struct sockaddr *)&clientAddr, &sin_size);
+        if (newfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        conn = new_connection(newfd, &clientAddr, metrics, log);
+        __atomic_fetch_add(&activeConnections, 1, __ATOMIC_RELAXED);
+        if (work_queue_push(&queue, conn) < 0) {
+            __atomic_fetch_sub(&activeConnections, 1, __ATOMIC_RELAXED);
+            reject_connection(conn);
+        }
+    }
+
+    // Idle keep-alive connections hold their thread until the idle timeout
+    deadline = now_ms() + DRAIN_TIMEOUT_MS;
+    while (__atomic_load_n(&activeConnections, __ATOMIC_ACQUIRE) > 0 && now_ms() < deadline) {
+        nanosleep(&interval, NULL);
+    }
+    return 0;
+}
+
+/**
+ * Pins the worker to a core, then serves connections from its own listening
+ * socket and event loop. The kernel balances the accepts between the workers
+ */
+void* run_worker(void *argument)
+{
+    struct worker *worker = (struct worker*)argument;
+    cpu_set_t cpuset;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(worker->id % sysconf(_SC_NPROCESSORS_ONLN), &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof cpuset, &cpuset) != 0) {
+        eprintf("server: could not pin worker %d\n", worker->id);
+    }
+
+    run_loop(worker->listenfd);
+    return NULL;
+}
+
+/**
+ * Starts a worker on each listening socket and waits for them to finish
+ */
+int run_workers()
+{
+    struct worker *workers = (struct worker*)calloc(numWorkers, sizeof(struct worker));
+    int i;
+
+    for (i = 0; i < numWorkers; i++)
+    {
+        workers[i].id = i;
+        workers[i].listenfd = listenFds[i];
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < numWorkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    return 0;
+}
+
+/**
+ * Raises the limit on open file descriptors as far as allowed so the event
+ * loop can hold many concurrent connections
+ */
+void raise_fd_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+#ifndef TEST
+
+/**
+ * Remembers the document root by the path it was entered through, which may
+ * go through a symbolic link swapped on deploys, rather than the directory
+ * it resolves to now
+ */
+void find_doc_root()
+{
+    const char *pwd = getenv("PWD");
+    struct stat a, b;
+
+    if (pwd != NULL && strlen(pwd) < sizeof docRoot && stat(pwd, &a) == 0 && stat(".", &b) == 0
+        && a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+        strcpy(docRoot, pwd);
+    }
+    else if (getcwd(docRoot, sizeof docRoot) == NULL) {
+        strcpy(docRoot, ".");
+    }
+}
+
+/**
+ * Gets the listening sockets, one per worker: first from the server running
+ * with the same handoff path, if any, which leaves *handoffFd connected to
+ * it, then by binding the port for the rest. Sockets handed over beyond the
+ * number of workers are closed. Returns -1 on error
+ */
+int take_listeners(const char *portNumber, int *handoffFd)
+{
+    int taken = 0;
+
+    listenCount = numWorkers > 0 ? numWorkers : 1;
+    if (handoffPath != NULL && (*handoffFd = handoff_connect(handoffPath)) >= 0)
+    {
+        if ((taken = handoff_receive(*handoffFd, listenFds, listenCount)) < 0) {
+            perror("server: handoff");
+            return -1;
+        }
+        printf("server: took over %d listening sockets\n", taken);
+        fflush(stdout);
+    }
+    for (; taken < listenCount; taken++)
+    {
+        if ((listenFds[taken] = open_socket_and_listen(portNumber, numWorkers > 0)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, proxying = 0, logging = 0;
+    int handoffFd = -1, handoffListenFd = -1;
+    sigset_t signals;
+    pthread_t thread;
+
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+    for (i = 1; i < argc - 1; i++)
+    {
+        if (strcmp("-t", argv[i]) == 0) {
+            threaded = 1;
+        }
+        else if (strcmp("-u", argv[i]) == 0) {
+            uring = 1;
+        }
+        else if (strcmp("-n", argv[i]) == 0 && i + 1 < argc - 1) {
+            numThreads = atoi(argv[++i]);
+            if (numThreads <= 0) {
+                eprintf("Invalid number of threads: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp("-q", argv[i]) == 0 && i + 1 < argc - 1) {
+            queueSize = atoi(argv[++i]);
+            if (queueSize <= 0) {
+                eprintf("Invalid queue length: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp("-l", argv[i]) == 0 && i + 1 < argc - 1) {
+            accessLogPath = argv[++i];
+        }
+        else if (strcmp("-p", argv[i]) == 0 && i + 1 < argc - 1) {
+            if (proxy_add_route(argv[++i]) < 0) {
+                eprintf("Invalid route: %s\n", argv[i]);
+                return 1;
+            }
+            proxying = 1;
+        }
+        else if (strcmp("-L", argv[i]) == 0) {
+            proxyBalance = BALANCE_LEAST_CONNECTIONS;
+        }
+        else if (strcmp("-P", argv[i]) == 0) {
+            preload = 1;
+        }
+        else if (strcmp("-M", argv[i]) == 0) {
+            publicMetrics = 1;
+        }
+        else if (strcmp("-H", argv[i]) == 0 && i + 1 < argc - 1) {
+            handoffPath = argv[++i];
+        }
+        else if (strcmp("-w", argv[i]) == 0 && i + 1 < argc - 1) {
+            numWorkers = atoi(argv[++i]);
+            if (numWorkers <= 0 || numWorkers > MAX_LISTENERS) {
+                eprintf("Invalid number of workers: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else {
+            eprintf("Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (threaded && numWorkers > 0) {
+        eprintf("-t and -w cannot be used together\n");
+        return 1;
+    }
+    if (threaded && uring) {
+        eprintf("-t and -u cannot be used together\n");
+        return 1;
+    }
+    // Exchanges with upstreams are driven by the epoll loop only
+    if (proxying && (threaded || uring)) {
+        eprintf("-p cannot be used with -t or -u\n");
+        return 1;
+    }
+
+    // Every thread started from here on inherits the mask, so only
+    // run_signals ever gets them
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    // A client closing early must only fail the send, also for sendfile and splice
+    signal(SIGPIPE, SIG_IGN);
+    if (pipe(wakeFds) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    find_doc_root();
+
+    if (take_listeners(argv[argc - 1], &handoffFd) < 0) {
+        return 1;
+    }
+
+    if (file_cache_init(CACHE_SIZE, CACHED_FILE_SIZE, CACHED_FDS) < 0) {
+        eprintf("server: cached files will be checked for changes on every request\n");
+    }
+    if (preload) {
+        printf("server: preloaded %zu files\n", file_cache_preload("."));
+    }
+
+    // The access log is written by its own thread, straight to the file
+    if (accessLogPath != NULL && (accessLogFd = open(accessLogPath, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+    {
+        perror("server: open");
+        return 1;
+    }
+    if (access_log_start(accessLogFd) < 0) {
+        eprintf("server: could not start the access log\n");
+    }
+    else {
+        logging = 1;
+    }
+    if (pthread_create(&thread, NULL, run_signals, &signals) != 0) {
+        perror("pthread_create");
+        return 1;
+    }
+
+    // Listen for the next server before telling the previous one to drain
+    if (handoffPath != NULL)
+    {
+        if ((handoffListenFd = handoff_listen(handoffPath)) < 0) {
+            perror("server: handoff socket");
+        }
+        else if (pthread_create(&thread, NULL, run_handoff, (void*)(long)handoffListenFd) != 0) {
+            perror("pthread_create");
+            close(handoffListenFd);
+        }
+    }
+    if (handoffFd >= 0)
+    {
+        if (write(handoffFd, "r", 1) < 0) {
+            perror("server: handoff");
+        }
+        close(handoffFd);
+    }
+
+    printf("server: waiting for connection...\n");
+    fflush(stdout);
+    if (threaded) {
+        run_threaded(listenFds[0]);
+    }
+    else if (numWorkers > 0) {
+        raise_fd_limit();
+        run_workers();
+    }
+    else {
+        raise_fd_limit();
+        run_loop(listenFds[0]);
+    }
+    for (i = 0; i < listenCount; i++) {
+        close(listenFds[i]);
+    }
+    if (logging) {
+        access_log_stop();
+    }
+    printf("Server stopped!\n");
+    return 0;
+}
+
+#else
+
+#define TEST_ITEMS 100000
+
+long long testSum;
+
+void* push_test_items(void *argument)
+{
+    struct work_queue *queue = (struct work_queue*)argument;
+    long i;
+    for (i = 1; i <= TEST_ITEMS; i++) {
+        while (work_queue_push(queue, (void*)i) < 0);
+    }
+    return NULL;
+}
+
+void* pop_test_items(void *argument)
+{
+    struct work_queue *queue = (struct work_queue*)argument;
+    long long sum = 0;
+    int i;
+    for (i = 0; i < TEST_ITEMS; i++) {
+        sum += (long)work_queue_pop(queue);
+    }
+    __atomic_fetch_add(&testSum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct http_request req;
+    struct byte_range ranges[MAX_RANGES];
+    char buf[256], text[METRICS_SIZE];
+    int i, len, rv;
+    struct metrics_shard *metrics;
+    struct access_log *log;
+    struct access_record *record;
+    FILE *tmp;
+    struct work_queue queue;
+    pthread_t threads[4];
+    int ok, sv[2], pipefd[2], fds[1], listenfd;
+    struct io_ring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct route *route;
+    struct upstream *up;
+
+    strcpy(buf, "GET /index.html HTTP/1.1\r\nHost: x\r\nConnection:  close \r\n\r\nGET /");
+    len = strstr(buf, CRLFCRLF) + strlen(CRLFCRLF) - buf;
+    http_request_init(&req);
+    check("Test parse_http_request", parse_http_request(&req, buf, strlen(buf)) == PARSE_DONE);
+    check("Test parse_http_request (method)", strcmp(buf + req.method.offset, "GET") == 0);
+    check("Test parse_http_request (uri)", strcmp(buf + req.uri.offset, "/index.html") == 0);
+    check("Test parse_http_request (version)", strcmp(buf + req.version.offset, "HTTP/1.1") == 0);
+    check("Test parse_http_request (length)", req.length == len);
+    check("Test http_request_header", strcmp(http_request_header(&req, buf, "connection"), "close") == 0);
+    check("Test http_request_header (missing)", http_request_header(&req, buf, "Accept") == NULL);
+
+    // Bytes arriving one at a time
+    strcpy(buf, "\r\nGET /a HTTP/1.1\r\nHost: x\r\n\r\n");
+    len = strlen(buf);
+    http_request_init(&req);
+    for (i = 1, rv = PARSE_AGAIN; i <= len && rv == PARSE_AGAIN; i++) {
+        rv = parse_http_request(&req, buf, i);
+    }
+    check("Test parse_http_request (split)", rv == PARSE_DONE && i == len + 1);
+    check("Test parse_http_request (split uri)", strcmp(buf + req.uri.offset, "/a") == 0);
+    check("Test parse_http_request (split header)", strcmp(http_request_header(&req, buf, "Host"), "x") == 0);
+
+    strcpy(buf, "GET /a HTTP/1.1\r\nBad header\r\n\r\n");
+    http_request_init(&req);
+    check("Test parse_http_request (malformed)", parse_http_request(&req, buf, strlen(buf)) == PARSE_ERROR);
+
+    check("Test parse_range", parse_range("bytes=0-99", 1000, ranges, MAX_RANGES) == 1 
+                              && ranges[0].start == 0 && ranges[0].end == 100);
+    check("Test parse_range (multiple)", parse_range("bytes=10-, -50 ,0-2000", 1000, ranges, MAX_RANGES) == 3
+                                         && ranges[0].start == 10 && ranges[0].end == 1000
+                                         && ranges[1].start == 950 && ranges[2].end == 1000);
+    check("Test parse_range (unsatisfiable)", parse_range("bytes=1000-, -0", 1000, ranges, MAX_RANGES) == 0);
+    check("Test parse_range (malformed)", parse_range("bytes=5-1", 1000, ranges, MAX_RANGES) == -1
+                                          && parse_range("items=0-1", 1000, ranges, MAX_RANGES) == -1
+                                          && parse_range("bytes=0-1,", 1000, ranges, MAX_RANGES) == -1);
+    check("Test parse_range (too many)", parse_range("bytes=0-0,1-1,2-2", 1000, ranges, 2) == -1);
+
+    check("Test etag_matches", etag_matches("\"a\", W/\"b-1\"", "\"b-1\"") && etag_matches("*", "\"a\""));
+    check("Test etag_matches (different)", !etag_matches("\"b-12\", \"b\"", "\"b-1\"") 
+                                           && !etag_matches("b-1", "\"b-1\""));
+
+    check("Test accepts_encoding", accepts_encoding("deflate, gzip;q=0.5", "gzip") 
+                                   && accepts_encoding("*", "gzip") && accepts_encoding("GZIP", "gzip"));
+    check("Test accepts_encoding (refused)", !accepts_encoding("gzip;q=0, *", "gzip") 
+                                             && !accepts_encoding("*;q=0.0", "gzip")
+                                             && !accepts_encoding("x-gzip, br", "gzip"));
+
+    check("Test normalize_path", normalize_path("/a//b/./c/../d.html?x=/../..", buf, sizeof buf) == 0 
+                                 && strcmp(buf, "a/b/d.html") == 0);
+    check("Test normalize_path (index)", normalize_path("/", buf, sizeof buf) == 0 && strcmp(buf, "index.html") == 0
+                                         && normalize_path("/a/b/..", buf, sizeof buf) == 0 
+                                         && strcmp(buf, "a/index.html") == 0);
+    check("Test normalize_path (escapes)", normalize_path("/a%20b/%2e%2E/c", buf, sizeof buf) == 0 
+                                           && strcmp(buf, "c") == 0);
+    check("Test normalize_path (outside)", normalize_path("/a/../../etc/passwd", buf, sizeof buf) < 0
+                                           && normalize_path("/%2e%2e/x", buf, sizeof buf) < 0);
+    check("Test normalize_path (malformed)", normalize_path("/a%00b", buf, sizeof buf) < 0 
+                                             && normalize_path("/a%2", buf, sizeof buf) < 0
+                                             && normalize_path("/abc", buf, 4) < 0);
+    check("Test file_mime_type", strcmp(file_mime_type("TMDG_files/PGheader.JPG")->name, "image/jpeg") == 0
+                                 && file_mime_type("show_ads.js")->compressible
+                                 && strcmp(file_mime_type("a.woff2")->name, "font/woff2") == 0);
+    check("Test file_mime_type (unknown)", strcmp(file_mime_type("a.b/c")->name, "application/octet-stream") == 0
+                                           && !file_compressible("README") && !file_compressible("a.xyz"));
+
+    metrics = metrics_acquire();
+    metrics_count_status(metrics, 404);
+    metrics_count_status(metrics, 302);
+    metrics_record(&metrics->send, 300);
+    metrics_record(&metrics->send, 2000000);
+    metrics_render(text, METRICS_SIZE);
+    check("Test metrics_render (counters)", strstr(text, "http_requests_total{code=\"404\"} 1\n") 
+                                            && strstr(text, "http_requests_total{code=\"other\"} 1\n"));
+    check("Test metrics_render (histogram)", strstr(text, "http_response_send_seconds_bucket{le=\"0.00025\"} 0\n")
+                                             && strstr(text, "http_response_send_seconds_bucket{le=\"0.0005\"} 1\n")
+                                             && strstr(text, "http_response_send_seconds_bucket{le=\"2.5\"} 2\n")
+                                             && strstr(text, "http_response_send_seconds_count 2\n"));
+    check("Test metrics_render (cut short)", metrics_render(text, 100) == 99 && strlen(text) == 99);
+
+    log = access_log_acquire();
+    for (i = 0; i < ACCESS_LOG_RING_SIZE; i++)
+    {
+        if ((record = access_log_reserve(log, 200)) != NULL)
+        {
+            memset(record, 0, sizeof *record);
+            access_log_copy(record->path, "/a b\"c", LOG_PATH_SIZE);
+            access_log_commit(log);
+        }
+    }
+    check("Test access_log_reserve (sampled)", log->head == ACCESS_LOG_RING_SIZE * 3 / 4 + ACCESS_LOG_RING_SIZE / 4 / ACCESS_LOG_SAMPLE_RATE
+                                               && log->sampled == ACCESS_LOG_RING_SIZE / 4 - ACCESS_LOG_RING_SIZE / 4 / ACCESS_LOG_SAMPLE_RATE);
+    while ((record = access_log_reserve(log, 500)) != NULL) {
+        access_log_commit(log);
+    }
+    check("Test access_log_reserve (dropped)", log->head == ACCESS_LOG_RING_SIZE && log->dropped == 1);
+    tmp = tmpfile();
+    len = access_log_flush(text, METRICS_SIZE, fileno(tmp));
+    check("Test access_log_flush", len > 0 && log->tail == log->head && access_log_reserve(log, 200) != NULL);
+    rewind(tmp);
+    check("Test access_log_flush (record)", fgets(text, METRICS_SIZE, tmp) && strstr(text, " path=/a?b?c status=0 "));
+    fseek(tmp, -60, SEEK_END);
+    check("Test access_log_flush (drops)", fread(text, 1, 60, tmp) == 60 && strstr(text, "dropped=1 sampled=") != NULL);
+    fclose(tmp);
+
+    work_queue_init(&queue, 3);
+    for (i = 1, ok = 1; i <= 4; i++) {
+        ok = ok && work_queue_push(&queue, (void*)(long)i) == 0;
+    }
+    check("Test work_queue_push (full)", ok && work_queue_push(&queue, (void*)5L) < 0);
+    for (i = 1; i <= 10; i++) {
+        ok = ok && (long)work_queue_pop(&queue) == i && work_queue_push(&queue, (void*)(long)(i + 4)) == 0;
+    }
+    for (i = 11; i <= 14; i++) {
+        ok = ok && (long)work_queue_pop(&queue) == i;
+    }
+    check("Test work_queue_pop (in order)", ok);
+    for (i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, i % 2 ? pop_test_items : push_test_items, &queue);
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    check("Test work_queue (threads)", testSum == (long long)TEST_ITEMS * (TEST_ITEMS + 1));
+
+    if (io_ring_init(&ring, 4) == 0 && io_ring_add_buffers(&ring, 2, 16) == 0)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        write(sv[1], "hello", 5);
+        sqe = io_ring_sqe(&ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->len = 16;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = IO_RING_BUFFER_GROUP;
+        sqe->user_data = 1;
+        io_ring_submit(&ring, 1000);
+        check("Test io_ring (provided buffer)", (cqe = io_ring_peek(&ring)) != NULL && cqe->res == 5
+                                                && (cqe->flags & IORING_CQE_F_BUFFER)
+                                                && memcmp(io_ring_buffer(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT), "hello", 5) == 0);
+        io_ring_recycle(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        io_ring_seen(&ring);
+
+        // The close only runs once the send is whole
+        io_ring_reserve(&ring, 2);
+        sqe = io_ring_sqe(&ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sv[0];
+        sqe->addr = (unsigned long)"bye";
+        sqe->len = 3;
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe = io_ring_sqe(&ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = sv[0];
+        io_ring_submit(&ring, 1000);
+        for (i = 0, ok = 1; i < 2; i++)
+        {
+            while ((cqe = io_ring_peek(&ring)) == NULL) {
+                io_ring_submit(&ring, 1000);
+            }
+            ok = ok && cqe->res == (i == 0 ? 3 : 0);
+            io_ring_seen(&ring);
+        }
+        check("Test io_ring (linked close)", ok && read(sv[1], buf, sizeof buf) == 3 && read(sv[1], buf, sizeof buf) == 0);
+        close(sv[1]);
+        io_ring_free(&ring);
+    }
+
+    check("Test proxy_add_route", proxy_add_route("/api=127.0.0.1:1,127.0.0.1:2,[::1]:3") == 0
+                                  && proxy_add_route("/api/v2=127.0.0.1:4") == 0);
+    check("Test proxy_add_route (malformed)", proxy_add_route("api=127.0.0.1:1") < 0
+                                              && proxy_add_route("/x=127.0.0.1") < 0 && proxy_add_route("/x=") < 0);
+    route = proxy_find_route("/api/v2/users");
+    check("Test proxy_find_route (longest prefix)", route != NULL && route->count == 1);
+    route = proxy_find_route("/api/v1");
+    check("Test proxy_find_route", route != NULL && route->count == 3 && proxy_find_route("/ap") == NULL);
+    check("Test proxy_find_route (whole segments)", proxy_find_route("/api") == route && proxy_find_route("/api?x=1") == route
+                                                    && proxy_find_route("/apix/y") == NULL && proxy_find_route("/api2") == NULL
+                                                    && proxy_find_route("/api/v2x") == route);
+    check("Test proxy_find_route (trailing slash)", proxy_add_route("/static/=127.0.0.1:5") == 0
+                                                    && proxy_find_route("/static/x") != NULL && proxy_find_route("/staticx") == NULL);
+    up = proxy_pick(route, BALANCE_ROUND_ROBIN, NULL);
+    check("Test proxy_pick (round robin)", proxy_pick(route, BALANCE_ROUND_ROBIN, NULL) == up + 1
+                                           && proxy_pick(route, BALANCE_ROUND_ROBIN, NULL) == up + 2
+                                           && proxy_pick(route, BALANCE_ROUND_ROBIN, up) == up + 1);
+    up[0].active = 2;
+    up[2].active = 1;
+    check("Test proxy_pick (least connections)", proxy_pick(route, BALANCE_LEAST_CONNECTIONS, NULL) == up + 1
+                                                 && proxy_pick(route, BALANCE_LEAST_CONNECTIONS, up + 1) == up + 2);
+    for (i = 0; i < UPSTREAM_MAX_FAILURES; i++) {
+        proxy_report(up + 1, 0);
+    }
+    proxy_report(up + 2, 0);
+    ok = 1;
+    for (i = 0; i < 6; i++) {
+        ok = ok && proxy_pick(route, BALANCE_ROUND_ROBIN, NULL) != up + 1;
+    }
+    check("Test proxy_report (down)", ok && up[2].failures == 1);
+    up[1].downUntil = 0;
+    proxy_report(up + 1, 0);
+    check("Test proxy_report (down again)", up[1].downUntil > now_ms());
+    proxy_report(up + 1, 1);
+    check("Test proxy_report (up)", up[1].failures == 0);
+
+    // The descriptors received are new ones for the same pipe, the ones
+    // beyond the limit are closed
+    listenfd = handoff_listen("/tmp/http_server_test.sock");
+    sv[0] = handoff_connect("/tmp/http_server_test.sock");
+    sv[1] = accept(listenfd, NULL, NULL);
+    check("Test handoff_connect", listenfd >= 0 && sv[0] >= 0 && sv[1] >= 0
+                                  && handoff_connect("/tmp/http_server_none.sock") < 0);
+    pipe(pipefd);
+    check("Test handoff_send", handoff_send(sv[1], pipefd, 2) == 0 && handoff_send(sv[1], pipefd, 0) < 0);
+    check("Test handoff_receive", handoff_receive(sv[0], fds, 1) == 1 && fds[0] != pipefd[0]
+                                  && write(pipefd[1], "x", 1) == 1 && read(fds[0], buf, 2) == 1 && buf[0] == 'x');
+    close(sv[0]);
+    check("Test handoff_receive (closed)", handoff_receive(sv[1], fds, 1) < 0);
+    close(sv[1]);
+    close(listenfd);
+    unlink("/tmp/http_server_test.sock");
+
+    return 0;
+}
+
+#endif
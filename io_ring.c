@@ -0,0 +1,264 @@
+#include "io_ring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+/**
+ * Sets up a ring with room for entries submissions, rounded up to a power of
+ * two by the kernel, and maps its queues. Returns -1 if io_uring is not
+ * available
+ */
+int io_ring_init(struct io_ring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    unsigned i;
+
+    memset(ring, 0, sizeof *ring);
+    memset(&p, 0, sizeof p);
+    // Only the thread of the loop submits, and completions can wait until it
+    // next enters the kernel. Older kernels do without the hints
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    {
+        memset(&p, 0, sizeof p);
+        if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+            return -1;
+        }
+    }
+    ring->entries = p.sq_entries;
+
+    ring->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqMapSize = ring->cqMapSize = max(ring->sqMapSize, ring->cqMapSize);
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        goto fail;
+    }
+    ring->cqMap = ring->sqMap;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    sq = (char*)ring->sqMap;
+    cq = (char*)ring->cqMap;
+    ring->sqHead = (unsigned*)(sq + p.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sqArray = (unsigned*)(sq + p.sq_off.array);
+    ring->sqTailLocal = *ring->sqTail;
+    ring->cqHead = (unsigned*)(cq + p.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    // Entry i always sits in slot i, so the array never changes
+    for (i = 0; i < p.sq_entries; i++) {
+        ring->sqArray[i] = i;
+    }
+    return 0;
+
+fail:
+    if (ring->sqMap != NULL && ring->sqMap != MAP_FAILED) {
+        munmap(ring->sqMap, ring->sqMapSize);
+    }
+    if (ring->cqMap != NULL && ring->cqMap != MAP_FAILED && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    close(ring->fd);
+    return -1;
+}
+
+unsigned queue_space(struct io_ring *ring)
+{
+    return ring->entries - (ring->sqTailLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Makes room for n more entries, submitting the queued ones if there is not
+ * enough. Entries linked together must be queued after reserving room for
+ * all of them, as a link does not carry over from one submission to the next.
+ * Returns -1 if there is no room
+ */
+int io_ring_reserve(struct io_ring *ring, unsigned n)
+{
+    if (queue_space(ring) < n && io_ring_submit(ring, 0) < 0) {
+        return -1;
+    }
+    return queue_space(ring) < n ? -1 : 0;
+}
+
+/**
+ * Returns a cleared submission entry to fill in, submitting the queued
+ * entries first if the queue is full. Returns NULL if they cannot be
+ */
+struct io_uring_sqe *io_ring_sqe(struct io_ring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (io_ring_reserve(ring, 1) < 0) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sqTailLocal & (ring->entries - 1)];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sqTailLocal++;
+    return sqe;
+}
+
+/**
+ * Hands the queued entries over to the kernel in one system call and waits
+ * for a completion, for at most timeoutMs if it is not negative.
+ * Returns -1 on error
+ */
+int io_ring_submit(struct io_ring *ring, int timeoutMs)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned submit, flags = 0;
+    int rv;
+
+    __atomic_store_n(ring->sqTail, ring->sqTailLocal, __ATOMIC_RELEASE);
+    submit = ring->sqTailLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    memset(&arg, 0, sizeof arg);
+    if (timeoutMs != 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (timeoutMs > 0)
+    {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        arg.ts = (unsigned long long)(unsigned long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    if (submit == 0 && flags == 0) {
+        return 0;
+    }
+    rv = syscall(__NR_io_uring_enter, ring->fd, submit, timeoutMs != 0 ? 1 : 0, flags,
+                 flags & IORING_ENTER_EXT_ARG ? (void*)&arg : NULL,
+                 flags & IORING_ENTER_EXT_ARG ? sizeof arg : 0);
+    // Running out of time or completions waiting to be reaped are no errors
+    if (rv < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the oldest completion not seen yet, or NULL if there is none
+ */
+struct io_uring_cqe *io_ring_peek(struct io_ring *ring)
+{
+    unsigned head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+/**
+ * Gives the completion returned by io_ring_peek back to the kernel
+ */
+void io_ring_seen(struct io_ring *ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Registers count buffers of size bytes in group IO_RING_BUFFER_GROUP, for
+ * receives with IOSQE_BUFFER_SELECT. count must be a power of two.
+ * Returns -1 if they cannot be registered
+ */
+int io_ring_add_buffers(struct io_ring *ring, unsigned count, unsigned size)
+{
+    struct io_uring_buf_reg reg;
+    size_t ringSize = count * sizeof(struct io_uring_buf);
+    unsigned i;
+
+    ring->bufRing = (struct io_uring_buf_ring*)mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufRing == MAP_FAILED) {
+        ring->bufRing = NULL;
+        return -1;
+    }
+    if ((ring->buffers = (char*)malloc((size_t)count * size)) == NULL) {
+        goto fail;
+    }
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long long)(unsigned long)ring->bufRing;
+    reg.ring_entries = count;
+    reg.bgid = IO_RING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto fail;
+    }
+    ring->bufferCount = count;
+    ring->bufferSize = size;
+    ring->bufTail = 0;
+    for (i = 0; i < count; i++) {
+        io_ring_recycle(ring, i);
+    }
+    return 0;
+
+fail:
+    free(ring->buffers);
+    ring->buffers = NULL;
+    munmap(ring->bufRing, ringSize);
+    ring->bufRing = NULL;
+    return -1;
+}
+
+/**
+ * Returns the buffer the kernel picked, by the id in the flags of the completion
+ */
+char *io_ring_buffer(struct io_ring *ring, unsigned id)
+{
+    return ring->buffers + (size_t)id * ring->bufferSize;
+}
+
+/**
+ * Gives the buffer back to the kernel once its data has been consumed
+ */
+void io_ring_recycle(struct io_ring *ring, unsigned id)
+{
+    struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (ring->bufferCount - 1)];
+
+    buf->addr = (unsigned long long)(unsigned long)io_ring_buffer(ring, id);
+    buf->len = ring->bufferSize;
+    buf->bid = id;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+void io_ring_free(struct io_ring *ring)
+{
+    // Closing the ring cancels the operations still in flight and
+    // unregisters the buffers
+    close(ring->fd);
+    if (ring->bufRing != NULL) {
+        munmap(ring->bufRing, ring->bufferCount * sizeof(struct io_uring_buf));
+        free(ring->buffers);
+    }
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    munmap(ring->sqMap, ring->sqMapSize);
+}
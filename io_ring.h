@@ -0,0 +1,46 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define IO_RING_BUFFER_GROUP 0
+
+/**
+ * io_uring instance set up with the raw system calls. Entries are queued in
+ * the submission queue shared with the kernel and all handed over at once by
+ * io_ring_submit, which also waits for completions. Receives can leave the
+ * choice of buffer to the kernel, which takes it from a ring of buffers
+ * given back once their data is consumed
+ */
+struct io_ring {
+    int fd;
+    unsigned entries;
+    unsigned *sqHead, *sqTail, *sqArray;
+    unsigned sqTailLocal;               // Queued entries end here, published on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqMap, *cqMap;
+    size_t sqMapSize, cqMapSize;
+
+    struct io_uring_buf_ring *bufRing;
+    char *buffers;
+    unsigned bufferCount;               // A power of two
+    unsigned bufferSize;
+    unsigned short bufTail;
+};
+
+int io_ring_init(struct io_ring *ring, unsigned entries);
+int io_ring_reserve(struct io_ring *ring, unsigned n);
+struct io_uring_sqe *io_ring_sqe(struct io_ring *ring);
+int io_ring_submit(struct io_ring *ring, int timeoutMs);
+struct io_uring_cqe *io_ring_peek(struct io_ring *ring);
+void io_ring_seen(struct io_ring *ring);
+int io_ring_add_buffers(struct io_ring *ring, unsigned count, unsigned size);
+char *io_ring_buffer(struct io_ring *ring, unsigned id);
+void io_ring_recycle(struct io_ring *ring, unsigned id);
+void io_ring_free(struct io_ring *ring);
+
+#endif
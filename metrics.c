@@ -0,0 +1,173 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Shards live as long as the server
+struct metrics_shard *shards;
+pthread_mutex_t shardsLock = PTHREAD_MUTEX_INITIALIZER;
+
+const int statusCodes[NUM_STATUS_CODES] = { 200, 206, 304, 400, 404, 405, 411, 416, 502, 503, 505 };
+
+// Upper bounds of the histogram buckets exported, in microseconds
+const long long bucketBounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+#define NUM_BOUNDS (int)(sizeof bucketBounds / sizeof bucketBounds[0])
+
+/**
+ * Adds a shard for a thread
+ */
+struct metrics_shard *metrics_acquire()
+{
+    struct metrics_shard *m = (struct metrics_shard*)calloc(1, sizeof(struct metrics_shard));
+
+    pthread_mutex_lock(&shardsLock);
+    m->next = shards;
+    shards = m;
+    pthread_mutex_unlock(&shardsLock);
+    return m;
+}
+
+/**
+ * Records the value in a histogram of the calling thread's shard
+ */
+void metrics_record(struct histogram *h, long long us)
+{
+    METRIC_ADD(h->counts[histogram_bucket(us)], 1);
+    METRIC_ADD(h->total, 1);
+    METRIC_ADD(h->sum, us);
+}
+
+void metrics_count_status(struct metrics_shard *m, int statusCode)
+{
+    int i;
+    for (i = 0; i < NUM_STATUS_CODES && statusCodes[i] != statusCode; i++);
+    METRIC_ADD(m->requests[i], 1);
+}
+
+void add_histogram(struct histogram *dst, struct histogram *src)
+{
+    int i;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * Text being rendered, always NUL-terminated. Output that does not fit in
+ * the buffer is dropped
+ */
+struct metrics_text {
+    char *buf;
+    size_t sz;
+    size_t len;
+};
+
+void text_append(struct metrics_text *t, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if (t->len + 1 >= t->sz) {
+        return;
+    }
+    va_start(args, format);
+    n = vsnprintf(t->buf + t->len, t->sz - t->len, format, args);
+    va_end(args);
+    t->len = n < 0 ? t->sz - 1 : min(t->len + n, t->sz - 1);
+}
+
+/**
+ * Appends a histogram in seconds, with cumulative buckets up to each bound.
+ * Values are counted by the fine-grained bucket they fall in, so a value just
+ * over a bound may be counted below it
+ */
+void render_histogram(struct metrics_text *t, const char *name, const char *help, const struct histogram *h)
+{
+    unsigned long long count = 0;
+    int i, b = 0;
+
+    text_append(t, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < HISTOGRAM_BUCKETS && b < NUM_BOUNDS; i++)
+    {
+        for (; b < NUM_BOUNDS && histogram_bucket_value(i) > bucketBounds[b]; b++) {
+            text_append(t, "%s_bucket{le=\"%g\"} %llu\n", name, bucketBounds[b] / 1e6, count);
+        }
+        count += h->counts[i];
+    }
+    for (; b < NUM_BOUNDS; b++) {
+        text_append(t, "%s_bucket{le=\"%g\"} %llu\n", name, bucketBounds[b] / 1e6, count);
+    }
+    text_append(t, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+                name, h->total, name, h->sum / 1e6, name, h->total);
+}
+
+/**
+ * Writes the totals of every shard into buf in the Prometheus text format.
+ * Returns the length of the text, cut short if it does not fit
+ */
+size_t metrics_render(char *buf, size_t sz)
+{
+    struct metrics_shard *total = (struct metrics_shard*)calloc(1, sizeof(struct metrics_shard));
+    struct metrics_shard *m;
+    struct metrics_text t = { buf, sz, 0 };
+    int i;
+
+    if (total == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&shardsLock);
+    for (m = shards; m != NULL; m = m->next)
+    {
+        total->accepted += __atomic_load_n(&m->accepted, __ATOMIC_RELAXED);
+        total->closed += __atomic_load_n(&m->closed, __ATOMIC_RELAXED);
+        total->bytesSent += __atomic_load_n(&m->bytesSent, __ATOMIC_RELAXED);
+        for (i = 0; i <= NUM_STATUS_CODES; i++) {
+            total->requests[i] += __atomic_load_n(&m->requests[i], __ATOMIC_RELAXED);
+        }
+        add_histogram(&total->firstByte, &m->firstByte);
+        add_histogram(&total->parse, &m->parse);
+        add_histogram(&total->fileOpen, &m->fileOpen);
+        add_histogram(&total->send, &m->send);
+    }
+    pthread_mutex_unlock(&shardsLock);
+
+    text_append(&t, "# HELP http_connections_accepted_total Connections accepted.\n"
+                    "# TYPE http_connections_accepted_total counter\n"
+                    "http_connections_accepted_total %llu\n", total->accepted);
+    // Shards are read one after the other, so a close may be seen without its accept
+    text_append(&t, "# HELP http_connections_active Connections open.\n"
+                    "# TYPE http_connections_active gauge\n"
+                    "http_connections_active %llu\n", total->accepted - min(total->closed, total->accepted));
+    text_append(&t, "# HELP http_response_bytes_total Response bytes sent.\n"
+                    "# TYPE http_response_bytes_total counter\n"
+                    "http_response_bytes_total %llu\n", total->bytesSent);
+    text_append(&t, "# HELP http_requests_total Requests answered, by status code.\n"
+                    "# TYPE http_requests_total counter\n");
+    for (i = 0; i < NUM_STATUS_CODES; i++) {
+        text_append(&t, "http_requests_total{code=\"%d\"} %llu\n", statusCodes[i], total->requests[i]);
+    }
+    text_append(&t, "http_requests_total{code=\"other\"} %llu\n", total->requests[NUM_STATUS_CODES]);
+
+    render_histogram(&t, "http_first_byte_seconds",
+                     "Time from accepting a connection to the first byte of its first response.",
+                     &total->firstByte);
+    render_histogram(&t, "http_request_parse_seconds",
+                     "Time from the first byte of a request to the end of its header.",
+                     &total->parse);
+    render_histogram(&t, "http_file_open_seconds",
+                     "Time looking up the file of a request, reading it in on a cache miss.",
+                     &total->fileOpen);
+    render_histogram(&t, "http_response_send_seconds",
+                     "Time from building a response to sending its last byte.",
+                     &total->send);
+    free(total);
+    return t.len;
+}
@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+#include "utils.h"
+
+#define METRICS_PATH "/metrics"
+#define METRICS_SIZE (1024 * 16)
+
+// Status codes counted on their own, the others are counted together
+#define NUM_STATUS_CODES 11
+
+/**
+ * Counters and histograms of one thread. Only that thread updates them, with
+ * METRIC_ADD and metrics_record, so the hot path takes no lock and shares no
+ * cache line; scrapes add up every shard. Histograms are in microseconds
+ */
+struct metrics_shard {
+    unsigned long long accepted;
+    unsigned long long closed;
+    unsigned long long bytesSent;
+    unsigned long long requests[NUM_STATUS_CODES + 1];
+    struct histogram firstByte;     // Accept to the first byte of the first response
+    struct histogram parse;         // First byte of a request to the end of its header
+    struct histogram fileOpen;      // Looking the file up, reading it in on a cache miss
+    struct histogram send;          // Building the response to sending its last byte
+
+    struct metrics_shard *next;
+};
+
+// Single writer, so a relaxed load and store is enough and a scrape never
+// sees a torn value
+#define METRIC_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+struct metrics_shard *metrics_acquire();
+void metrics_record(struct histogram *h, long long us);
+void metrics_count_status(struct metrics_shard *m, int statusCode);
+size_t metrics_render(char *buf, size_t sz);
+
+#endif
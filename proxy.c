@@ -0,0 +1,840 @@
+#define _GNU_SOURCE
+
+#include "proxy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define SPLICE_SIZE (1024 * 64)
+#define CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n"
+
+struct route routes[MAX_ROUTES];
+int numRoutes = 0;
+
+// Header fields that only concern one hop and are not forwarded
+const char *hopByHop[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", "Expect", NULL };
+
+// Methods whose requests can be sent again, as sending them twice has the
+// same effect as once
+const char *idempotent[] = { "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE", NULL };
+
+int is_hop_by_hop(const char *name, size_t len)
+{
+    int i;
+    for (i = 0; hopByHop[i] != NULL; i++) {
+        if (strlen(hopByHop[i]) == len && strncasecmp(name, hopByHop[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int is_idempotent(const char *method)
+{
+    int i;
+    for (i = 0; idempotent[i] != NULL; i++) {
+        if (strcmp(method, idempotent[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Adds a route from a "prefix=host:port[,host:port...]" spec, resolving the
+ * upstreams once. Returns -1 if the spec is malformed or a host is unknown
+ */
+int proxy_add_route(const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    char buf[1024], *hostPort, *host, *port, *save;
+    struct route *route = &routes[numRoutes];
+    struct upstream *upstream;
+    struct addrinfo hints, *ai;
+
+    if (eq == NULL || spec[0] != '/' || numRoutes == MAX_ROUTES
+        || eq - spec >= URI_SIZE || strlen(eq + 1) >= sizeof buf) {
+        return -1;
+    }
+    memset(route, 0, sizeof *route);
+    memcpy(route->prefix, spec, eq - spec);
+    route->prefixLength = eq - spec;
+    strcpy(buf, eq + 1);
+
+    for (hostPort = strtok_r(buf, ",", &save); hostPort != NULL; hostPort = strtok_r(NULL, ",", &save))
+    {
+        upstream = &route->upstreams[route->count];
+        if (route->count == MAX_UPSTREAMS || strlen(hostPort) >= sizeof upstream->name
+            || (port = strrchr(hostPort, ':')) == NULL) {
+            return -1;
+        }
+        strcpy(upstream->name, hostPort);
+        *port++ = '\0';
+        // IPv6 addresses are written in brackets
+        host = hostPort;
+        if (host[0] == '[' && port - host >= 3 && port[-2] == ']') {
+            host++;
+            port[-2] = '\0';
+        }
+
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port, &hints, &ai) != 0) {
+            return -1;
+        }
+        memcpy(&upstream->addr, ai->ai_addr, ai->ai_addrlen);
+        upstream->addrLength = ai->ai_addrlen;
+        freeaddrinfo(ai);
+        route->count++;
+    }
+    if (route->count == 0) {
+        return -1;
+    }
+    numRoutes++;
+    return 0;
+}
+
+/**
+ * Returns the route with the longest prefix of the path, or NULL if the
+ * request is not proxied. A prefix only matches whole segments, so /api
+ * takes /api, /api/x and /api?x but not /apix, unless it ends in /
+ */
+struct route *proxy_find_route(const char *uri)
+{
+    struct route *best = NULL;
+    struct route *r;
+    char next;
+    int i;
+
+    for (i = 0; i < numRoutes; i++)
+    {
+        r = &routes[i];
+        if (strncmp(uri, r->prefix, r->prefixLength) != 0) {
+            continue;
+        }
+        next = uri[r->prefixLength];
+        if ((r->prefix[r->prefixLength - 1] == '/' || next == '\0' || next == '/' || next == '?')
+            && (best == NULL || r->prefixLength > best->prefixLength)) {
+            best = r;
+        }
+    }
+    return best;
+}
+
+/**
+ * Picks the upstream for the next exchange of the route, other than skip and
+ * the ones failing. Round robin takes them in turn, least connections the
+ * one with the fewest exchanges in flight, in turn among equals.
+ * Returns NULL if there is none left
+ */
+struct upstream *proxy_pick(struct route *route, int balance, struct upstream *skip)
+{
+    unsigned start = __atomic_fetch_add(&route->next, 1, __ATOMIC_RELAXED);
+    long long now = now_ms();
+    struct upstream *u, *best = NULL;
+    int i;
+
+    for (i = 0; i < route->count; i++)
+    {
+        u = &route->upstreams[(start + i) % route->count];
+        if (u == skip || __atomic_load_n(&u->downUntil, __ATOMIC_RELAXED) > now) {
+            continue;
+        }
+        if (balance == BALANCE_ROUND_ROBIN) {
+            return u;
+        }
+        if (best == NULL || __atomic_load_n(&u->active, __ATOMIC_RELAXED)
+                            < __atomic_load_n(&best->active, __ATOMIC_RELAXED)) {
+            best = u;
+        }
+    }
+    return best;
+}
+
+/**
+ * Records whether the upstream answered. After UPSTREAM_MAX_FAILURES
+ * failures in a row it is skipped for UPSTREAM_RETRY_MS, then given requests
+ * again, but a single failure skips it anew
+ */
+void proxy_report(struct upstream *upstream, int ok)
+{
+    if (ok) {
+        __atomic_store_n(&upstream->failures, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    if (__atomic_add_fetch(&upstream->failures, 1, __ATOMIC_RELAXED) >= UPSTREAM_MAX_FAILURES)
+    {
+        __atomic_store_n(&upstream->downUntil, now_ms() + UPSTREAM_RETRY_MS, __ATOMIC_RELAXED);
+        __atomic_store_n(&upstream->failures, UPSTREAM_MAX_FAILURES - 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Takes the most recently pooled connection to the upstream. Connections the
+ * upstream closed meanwhile are dropped. Returns -1 if there is none
+ */
+int pool_take(struct upstream_pool *pool, struct upstream *upstream)
+{
+    int i, fd;
+    char c;
+
+    for (i = pool->count - 1; i >= 0; i--)
+    {
+        if (pool->upstreams[i] != upstream) {
+            continue;
+        }
+        fd = pool->fds[i];
+        pool->count--;
+        memmove(&pool->upstreams[i], &pool->upstreams[i + 1], (pool->count - i) * sizeof(struct upstream*));
+        memmove(&pool->fds[i], &pool->fds[i + 1], (pool->count - i) * sizeof(int));
+        // An idle connection has nothing to read unless the upstream closed it
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * Keeps the connection for a later exchange with the upstream, closing the
+ * oldest pooled one if the pool is full
+ */
+void pool_put(struct upstream_pool *pool, struct upstream *upstream, int fd)
+{
+    if (pool->count == IDLE_UPSTREAMS)
+    {
+        close(pool->fds[0]);
+        pool->count--;
+        memmove(&pool->upstreams[0], &pool->upstreams[1], pool->count * sizeof(struct upstream*));
+        memmove(&pool->fds[0], &pool->fds[1], pool->count * sizeof(int));
+    }
+    pool->upstreams[pool->count] = upstream;
+    pool->fds[pool->count] = fd;
+    pool->count++;
+}
+
+/**
+ * Starts connecting to the upstream without waiting for the handshake, which
+ * completes or fails by the time the socket is first written to
+ */
+int connect_upstream(struct upstream *upstream)
+{
+    int fd, yes = 1;
+
+    if ((fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    if (connect(fd, (struct sockaddr*)&upstream->addr, upstream->addrLength) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Gives a connection to the upstream to the exchange, from the pool if
+ * pooled is set and there is one. Returns -1 if it cannot connect
+ */
+int use_upstream(struct proxy_exchange *x, struct upstream *upstream, int pooled)
+{
+    struct epoll_event ev;
+
+    x->upstream = upstream;
+    x->fd = pooled ? pool_take(x->pool, upstream) : -1;
+    x->fresh = x->fd < 0;
+    if (x->fresh && (x->fd = connect_upstream(upstream)) < 0) {
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = x->tag;
+    if (epoll_ctl(x->epfd, EPOLL_CTL_ADD, x->fd, &ev) < 0)
+    {
+        close(x->fd);
+        x->fd = -1;
+        return -1;
+    }
+    __atomic_fetch_add(&upstream->active, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Picks an upstream other than the last one tried and connects to it, trying
+ * each upstream of the route at most once. Returns -1 with the status to
+ * answer with if none can be used
+ */
+int open_upstream(struct proxy_exchange *x)
+{
+    struct upstream *upstream;
+
+    while (x->tries < x->route->count)
+    {
+        if ((upstream = proxy_pick(x->route, x->balance, x->upstream)) == NULL) {
+            break;
+        }
+        x->tries++;
+        if (use_upstream(x, upstream, 1) == 0) {
+            return 0;
+        }
+        proxy_report(upstream, 0);
+    }
+    // Every upstream is failing, or failed for this request
+    x->statusCode = x->tries == 0 ? 503 : 502;
+    return -1;
+}
+
+/**
+ * Lets go of the upstream connection, pooling it if it can take another
+ * request. Closing it also removes it from the epoll set
+ */
+void release_upstream(struct proxy_exchange *x, int reuse)
+{
+    if (x->fd < 0) {
+        return;
+    }
+    __atomic_fetch_sub(&x->upstream->active, 1, __ATOMIC_RELAXED);
+    if (reuse && epoll_ctl(x->epfd, EPOLL_CTL_DEL, x->fd, NULL) == 0) {
+        pool_put(x->pool, x->upstream, x->fd);
+    }
+    else {
+        close(x->fd);
+    }
+    x->fd = -1;
+}
+
+/**
+ * Empties the pipe of a relay that was cut short, by replacing it
+ */
+void drop_pipe(struct proxy_exchange *x)
+{
+    if (x->pipeLength > 0)
+    {
+        close(x->pipefd[0]);
+        close(x->pipefd[1]);
+        x->pipefd[0] = x->pipefd[1] = -1;
+        x->pipeLength = 0;
+    }
+}
+
+struct proxy_exchange *proxy_exchange_new(int clientFd, int epfd, void *tag, struct upstream_pool *pool)
+{
+    struct proxy_exchange *x = (struct proxy_exchange*)calloc(1, sizeof(struct proxy_exchange));
+
+    x->clientFd = clientFd;
+    x->epfd = epfd;
+    x->tag = tag;
+    x->pool = pool;
+    x->fd = x->pipefd[0] = x->pipefd[1] = -1;
+    x->state = X_DONE;
+    return x;
+}
+
+/**
+ * Releases the exchange, and the upstream connection if it was given up on
+ */
+void proxy_exchange_free(struct proxy_exchange *x)
+{
+    release_upstream(x, 0);
+    if (x->pipefd[0] >= 0) {
+        close(x->pipefd[0]);
+        close(x->pipefd[1]);
+    }
+    free(x);
+}
+
+/**
+ * Appends to the head being built.
+ * Returns -1, leaving *len as it was, if it does not fit
+ */
+int head_append(struct proxy_exchange *x, size_t *len, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(x->head + *len, PROXY_HEAD_SIZE - *len, format, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= PROXY_HEAD_SIZE - *len) {
+        return -1;
+    }
+    *len += n;
+    return 0;
+}
+
+/**
+ * Points the buffers to send to the request head and the body bytes that
+ * came with it
+ */
+void rewind_request(struct proxy_exchange *x)
+{
+    x->iov[0].iov_base = x->head;
+    x->iov[0].iov_len = x->headLength;
+    x->iov[1].iov_base = (char*)x->body;
+    x->iov[1].iov_len = x->bodyLength;
+    x->iovIndex = 0;
+    x->requestSent = 0;
+}
+
+/**
+ * Starts forwarding the request parsed in place in buf, of which received
+ * bytes have arrived, to an upstream of the route: the request line and
+ * header are rebuilt without the fields of the hop and with the client added
+ * to X-Forwarded-For. A body must come with a Content-Length.
+ * Returns -1 with x->statusCode set to the status to answer with if the
+ * request cannot be forwarded
+ */
+int proxy_start(struct proxy_exchange *x, struct route *route, int balance, const char *buf,
+                const struct http_request *req, size_t received, const char *client, int keepAlive)
+{
+    const char *method = buf + req->method.offset;
+    const char *contentLength = http_request_header(req, buf, "Content-Length");
+    const char *expect = http_request_header(req, buf, "Expect");
+    const struct header_field *field;
+    char *end;
+    long long length = 0;
+    size_t len = 0;
+    int i;
+
+    x->route = route;
+    x->balance = balance;
+    x->upstream = NULL;
+    x->tries = 0;
+    x->inLength = 0;
+    x->sent = 0;
+    x->statusCode = 502;
+    x->headRequest = strcmp(method, "HEAD") == 0;
+    x->keepAlive = keepAlive;
+    http_response_init(&x->res);
+
+    // Relaying a chunked body would mean decoding it on the way
+    if (http_request_header(req, buf, "Transfer-Encoding") != NULL) {
+        x->statusCode = 411;
+        return -1;
+    }
+    if (contentLength != NULL && ((length = strtoll(contentLength, &end, 10)) < 0 || *end != '\0' || end == contentLength)) {
+        x->statusCode = 400;
+        return -1;
+    }
+
+    // A head that does not fit once rebuilt is refused rather than cut short
+    x->statusCode = 431;
+    if (head_append(x, &len, "%s %s HTTP/1.1\r\n", method, buf + req->uri.offset) < 0) {
+        return -1;
+    }
+    for (i = 0; i < req->headers.count; i++)
+    {
+        field = &req->headers.fields[i];
+        if (!is_hop_by_hop(buf + field->name, field->nameLength)
+            && head_append(x, &len, "%s: %s\r\n", buf + field->name, buf + field->value) < 0) {
+            return -1;
+        }
+    }
+    if (head_append(x, &len, "X-Forwarded-For: %s\r\n\r\n", client) < 0) {
+        return -1;
+    }
+    x->headLength = len;
+    x->statusCode = 502;
+
+    x->body = buf + req->length;
+    x->bodyLength = min(received - req->length, (size_t)length);
+    x->requestBody = length - x->bodyLength;
+    // Only an idempotent request whose body is all in memory can be sent
+    // again once the upstream may have seen it
+    x->replayable = x->requestBody == 0 && is_idempotent(method);
+    rewind_request(x);
+
+    // Clients waiting for the go-ahead before sending the body get it from us
+    // before the body is relayed, as the header field is not forwarded
+    x->continueLeft = 0;
+    if (x->requestBody > 0 && expect != NULL && strcasecmp(expect, "100-continue") == 0) {
+        x->continueLeft = strlen(CONTINUE_RESPONSE);
+    }
+
+    if (open_upstream(x) < 0) {
+        return -1;
+    }
+    x->state = X_SEND_REQUEST;
+    return 0;
+}
+
+/**
+ * Sends the buffers that are left to fd, counting the bytes in *count.
+ * Returns 1 once they are sent, 0 if the socket would block and -1 on error
+ */
+int send_buffers_to(struct proxy_exchange *x, int fd, long long *count)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof msg);
+    while (x->iovIndex < 2)
+    {
+        if (x->iov[x->iovIndex].iov_len == 0) {
+            x->iovIndex++;
+            continue;
+        }
+        msg.msg_iov = x->iov + x->iovIndex;
+        msg.msg_iovlen = 2 - x->iovIndex;
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        *count += n;
+        while (x->iovIndex < 2 && (size_t)n >= x->iov[x->iovIndex].iov_len) {
+            n -= x->iov[x->iovIndex].iov_len;
+            x->iovIndex++;
+        }
+        if (n > 0) {
+            x->iov[x->iovIndex].iov_base = (char*)x->iov[x->iovIndex].iov_base + n;
+            x->iov[x->iovIndex].iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Sends what is left of the 100 Continue owed to the client.
+ * Returns like send_buffers_to
+ */
+int send_continue(struct proxy_exchange *x)
+{
+    const char *response = CONTINUE_RESPONSE;
+    ssize_t n;
+
+    while (x->continueLeft > 0)
+    {
+        n = send(x->clientFd, response + strlen(response) - x->continueLeft, x->continueLeft, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        x->continueLeft -= n;
+        x->sent += n;
+    }
+    return 1;
+}
+
+/**
+ * Moves *left bytes, or everything until from is closed if *left is
+ * negative, from one socket to the other through the pipe without copying
+ * them. Returns 1 once they are moved, 0 if a socket would block and -1 on
+ * error or if from is closed early
+ */
+int relay(struct proxy_exchange *x, int from, int to, long long *left, long long *sent)
+{
+    ssize_t n;
+
+    if (x->pipefd[0] < 0 && pipe2(x->pipefd, O_NONBLOCK) < 0) {
+        return -1;
+    }
+    while (*left != 0 || x->pipeLength > 0)
+    {
+        if (x->pipeLength == 0)
+        {
+            n = splice(from, NULL, x->pipefd[1], NULL, *left < 0 ? SPLICE_SIZE : min(SPLICE_SIZE, *left),
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                return errno == EAGAIN ? 0 : -1;
+            }
+            if (n == 0) {
+                return *left < 0 ? 1 : -1;
+            }
+            x->pipeLength = n;
+            if (*left > 0) {
+                *left -= n;
+            }
+        }
+        n = splice(x->pipefd[0], NULL, to, NULL, x->pipeLength,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (*left != 0 ? SPLICE_F_MORE : 0));
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        x->pipeLength -= n;
+        if (sent != NULL) {
+            *sent += n;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Body sink that only follows the framing of a body relayed as it is
+ */
+long skip_body(void *arg, const char *data, size_t len)
+{
+    return len;
+}
+
+/**
+ * Receives the response head from the upstream. Interim 1xx responses are
+ * not passed on. Returns 1 once the head is complete, 0 if the upstream
+ * would block and -1 if it failed or closed the connection first
+ */
+int recv_response_head(struct proxy_exchange *x)
+{
+    long used;
+    ssize_t n;
+
+    while (1)
+    {
+        if (x->inLength > 0)
+        {
+            if ((used = parse_response_head(&x->res, x->in, x->inLength)) < 0) {
+                return -1;
+            }
+            x->inLength -= used;
+            memmove(x->in, x->in + used, x->inLength);
+            if (x->res.headDone && x->res.statusCode / 100 != 1) {
+                return 1;
+            }
+            if (x->res.headDone) {
+                http_response_init(&x->res);
+                continue;
+            }
+        }
+        if ((n = recv(x->fd, x->in + x->inLength, PROXY_BUFFER_SIZE - x->inLength, 0)) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        x->inLength += n;
+    }
+}
+
+/**
+ * Rewrites the response head for the client once it is received, without
+ * the fields of the hop, and sends it with the body bytes that came with it.
+ * Returns -1 if the rewritten head does not fit
+ */
+int start_response(struct proxy_exchange *x)
+{
+    const char *headers = x->res.head + x->res.statusLength + strlen(CRLF);
+    const struct header_field *field;
+    size_t len = 0;
+    long consumed;
+    int i;
+
+    if (x->headRequest)
+    {
+        x->res.body.framing = BODY_NONE;
+        x->res.body.done = 1;
+    }
+    // Bytes after the end of the body mean the upstream cannot be trusted with another request
+    consumed = decode_body(&x->res.body, x->in, x->inLength, skip_body, NULL);
+    if (consumed < 0 || (size_t)consumed < x->inLength) {
+        x->res.keepAlive = 0;
+    }
+    x->inLength = max(consumed, 0);
+    if (x->res.body.framing == BODY_UNTIL_CLOSE) {
+        x->keepAlive = 0;
+    }
+
+    if (head_append(x, &len, "%.*s\r\n", x->res.statusLength, x->res.head) < 0) {
+        return -1;
+    }
+    for (i = 0; i < x->res.headers.count; i++)
+    {
+        field = &x->res.headers.fields[i];
+        if (!is_hop_by_hop(headers + field->name, field->nameLength)
+            && head_append(x, &len, "%.*s: %.*s\r\n", field->nameLength, headers + field->name,
+                           field->valueLength, headers + field->value) < 0) {
+            return -1;
+        }
+    }
+    if (head_append(x, &len, "%s\r\n", x->keepAlive ? "" : "Connection: close\r\n") < 0) {
+        return -1;
+    }
+
+    x->iov[0].iov_base = x->head;
+    x->iov[0].iov_len = len;
+    x->iov[1].iov_base = x->in;
+    x->iov[1].iov_len = x->inLength;
+    x->iovIndex = 0;
+    x->statusCode = x->res.statusCode;
+    return 0;
+}
+
+/**
+ * Relays a chunked body through the buffer as it is, following its framing
+ * to find where it ends. Returns like relay
+ */
+int relay_chunked(struct proxy_exchange *x)
+{
+    long consumed;
+    ssize_t n;
+    int rv;
+
+    while (1)
+    {
+        if ((rv = send_buffers_to(x, x->clientFd, &x->sent)) != 1) {
+            return rv;
+        }
+        if (x->res.body.done) {
+            return 1;
+        }
+        if ((n = recv(x->fd, x->in, PROXY_BUFFER_SIZE, 0)) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0 || (consumed = decode_body(&x->res.body, x->in, n, skip_body, NULL)) < 0) {
+            return -1;
+        }
+        if (consumed < n) {
+            x->res.keepAlive = 0;
+        }
+        x->iov[0].iov_len = 0;
+        x->iov[1].iov_base = x->in;
+        x->iov[1].iov_len = consumed;
+        x->iovIndex = 0;
+    }
+}
+
+/**
+ * Called when the upstream connection failed before the response head came.
+ * Moves the exchange to another connection if the request can safely be sent
+ * again: a pooled connection the upstream had closed is replaced by a new
+ * one, for an idempotent request or one not sent at all yet, and a new one
+ * that could not connect by one to the next upstream.
+ * Returns -1 if it cannot be
+ */
+int retry(struct proxy_exchange *x)
+{
+    int stale = !x->fresh && (x->replayable || x->requestSent == 0) && x->res.headLength == 0 && x->inLength == 0;
+    int refused = x->fresh && x->state == X_SEND_REQUEST && x->requestSent == 0;
+
+    release_upstream(x, 0);
+    if (stale && use_upstream(x, x->upstream, 0) == 0)
+    {
+        x->state = X_SEND_REQUEST;
+        rewind_request(x);
+        return 0;
+    }
+    proxy_report(x->upstream, 0);
+    if (refused && open_upstream(x) == 0)
+    {
+        x->state = X_SEND_REQUEST;
+        rewind_request(x);
+        return 0;
+    }
+    x->statusCode = 502;
+    return -1;
+}
+
+/**
+ * Moves the exchange on as far as the sockets allow.
+ * Returns 1 once the response is relayed, 0 if a socket would block before
+ * that and -1 on error. Before the response head is sent, the client can
+ * still be answered with x->statusCode
+ */
+int proxy_step(struct proxy_exchange *x)
+{
+    long long left;
+    int rv;
+
+    while (1)
+    {
+        switch (x->state)
+        {
+        case X_SEND_REQUEST:
+            if ((rv = send_buffers_to(x, x->fd, &x->requestSent)) == 0) {
+                return 0;
+            }
+            if (rv < 0 && retry(x) < 0) {
+                return -1;
+            }
+            if (rv > 0) {
+                x->state = X_SEND_BODY;
+            }
+            break;
+        case X_SEND_BODY:
+            if ((rv = send_continue(x)) == 1) {
+                rv = relay(x, x->clientFd, x->fd, &x->requestBody, NULL);
+            }
+            if (rv == 0) {
+                return 0;
+            }
+            if (rv < 0)
+            {
+                // Either side may have failed, so the upstream is not blamed
+                drop_pipe(x);
+                release_upstream(x, 0);
+                return -1;
+            }
+            x->state = X_RECV_HEAD;
+            break;
+        case X_RECV_HEAD:
+            if ((rv = recv_response_head(x)) == 0) {
+                return 0;
+            }
+            if (rv < 0 && retry(x) < 0) {
+                return -1;
+            }
+            if (rv > 0)
+            {
+                proxy_report(x->upstream, 1);
+                if (start_response(x) < 0)
+                {
+                    // The response is answered with 502 instead of cut short
+                    release_upstream(x, 0);
+                    x->statusCode = 502;
+                    return -1;
+                }
+                x->state = X_SEND_HEAD;
+            }
+            break;
+        case X_SEND_HEAD:
+            if ((rv = send_buffers_to(x, x->clientFd, &x->sent)) != 1) {
+                break;
+            }
+            x->state = X_RELAY_BODY;
+            break;
+        case X_RELAY_BODY:
+            if (x->res.body.done) {
+                rv = 1;
+            }
+            else if (x->res.body.framing == BODY_CHUNKED) {
+                rv = relay_chunked(x);
+            }
+            else
+            {
+                left = x->res.body.framing == BODY_UNTIL_CLOSE ? -1 : x->res.body.remaining;
+                rv = relay(x, x->fd, x->clientFd, &left, &x->sent);
+                if (left >= 0) {
+                    x->res.body.remaining = left;
+                }
+            }
+            if (rv == 1)
+            {
+                x->res.body.done = 1;
+                release_upstream(x, x->res.keepAlive);
+                x->state = X_DONE;
+            }
+            break;
+        case X_DONE:
+            return 1;
+        }
+        if (x->state == X_SEND_HEAD || x->state == X_RELAY_BODY)
+        {
+            if (rv == 0) {
+                return 0;
+            }
+            if (rv < 0)
+            {
+                drop_pipe(x);
+                release_upstream(x, 0);
+                return -1;
+            }
+        }
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "http_parser.h"
+#include "utils.h"
+
+#define MAX_ROUTES 16
+#define MAX_UPSTREAMS 8                 // Per route
+#define UPSTREAM_MAX_FAILURES 3         // Failures in a row before an upstream is skipped
+#define UPSTREAM_RETRY_MS 10000         // How long it is skipped for
+#define IDLE_UPSTREAMS 32               // Keep-alive upstream connections pooled per event loop
+#define PROXY_BUFFER_SIZE (1024 * 16)
+#define PROXY_HEAD_SIZE (RESPONSE_HEAD_SIZE + 256)
+
+#define BALANCE_ROUND_ROBIN 0
+#define BALANCE_LEAST_CONNECTIONS 1
+
+// States of an exchange
+#define X_SEND_REQUEST 0                // Rebuilt head and buffered start of the body
+#define X_SEND_BODY 1                   // Rest of the body, spliced from the client
+#define X_RECV_HEAD 2
+#define X_SEND_HEAD 3                   // Rewritten head and buffered start of the body
+#define X_RELAY_BODY 4
+#define X_DONE 5
+
+/**
+ * Backend server of a route. The counters are shared by every event loop and
+ * updated with relaxed atomics, so health and load are only approximate
+ */
+struct upstream {
+    char name[64];                      // host:port
+    struct sockaddr_storage addr;
+    socklen_t addrLength;
+    int active;                         // Exchanges in flight
+    int failures;                       // Failures in a row
+    long long downUntil;                // Skipped until then, in ms
+};
+
+/**
+ * Requests whose path starts with prefix go to one of the upstreams
+ */
+struct route {
+    char prefix[URI_SIZE];
+    size_t prefixLength;
+    struct upstream upstreams[MAX_UPSTREAMS];
+    int count;
+    unsigned next;                      // Round-robin position
+};
+
+/**
+ * Idle keep-alive connections to upstreams, owned by one event loop
+ */
+struct upstream_pool {
+    struct upstream *upstreams[IDLE_UPSTREAMS];
+    int fds[IDLE_UPSTREAMS];
+    int count;
+};
+
+/**
+ * One request forwarded to an upstream and its response relayed back.
+ * Everything is non-blocking: proxy_step moves the exchange on as far as the
+ * sockets allow, and the event loop calls it again when either socket is
+ * ready. The upstream socket is registered with epfd under tag while the
+ * exchange uses it
+ */
+struct proxy_exchange {
+    int state;
+    struct route *route;
+    int balance;
+    struct upstream *upstream;
+    int fd;                             // Upstream socket, -1 before it is picked
+    int fresh;                          // Connected for this exchange, not taken from the pool
+    int tries;                          // Upstreams tried
+    int clientFd;
+    int epfd;
+    void *tag;
+    struct upstream_pool *pool;
+
+    // Request head rebuilt for the upstream, then the response head rewritten
+    // for the client, each followed by the body bytes that came with it
+    char head[PROXY_HEAD_SIZE];
+    size_t headLength;
+    struct iovec iov[2];
+    int iovIndex;
+    const char *body;                   // Body bytes received with the request head
+    size_t bodyLength;
+    long long requestBody;              // Request body left to splice from the client
+    long long requestSent;              // Bytes sent to the upstream connection
+    int replayable;                     // The request can be sent again on another connection
+    size_t continueLeft;                // Bytes of the 100 Continue left to send to the client
+
+    struct http_response res;
+    int headRequest;                    // The response has no body whatever its header says
+    int keepAlive;                      // Whether the client connection stays open
+    char in[PROXY_BUFFER_SIZE];         // Bytes from the upstream
+    size_t inLength;
+    int pipefd[2];
+    size_t pipeLength;
+    long long sent;                     // Bytes sent to the client
+    int statusCode;                     // Of the response, or the one to answer with on failure
+};
+
+int proxy_add_route(const char *spec);
+struct route *proxy_find_route(const char *uri);
+struct upstream *proxy_pick(struct route *route, int balance, struct upstream *skip);
+void proxy_report(struct upstream *upstream, int ok);
+
+struct proxy_exchange *proxy_exchange_new(int clientFd, int epfd, void *tag, struct upstream_pool *pool);
+int proxy_start(struct proxy_exchange *x, struct route *route, int balance, const char *buf,
+                const struct http_request *req, size_t received, const char *client, int keepAlive);
+int proxy_step(struct proxy_exchange *x);
+void proxy_exchange_free(struct proxy_exchange *x);
+
+#endif
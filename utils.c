@@ -1,12 +1,21 @@
+#define _GNU_SOURCE
+
 #include "utils.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define HTTP_SCHEME "http://"
 #define HTTPS_SCHEME "https://"
+#define ARENA_ALIGN 16
 
 struct timeval savedTime;
 
@@ -17,6 +26,16 @@ void print_buffer(const char* name, const char* buffer)
     printf("============ END %s ============\n", name);
 }
 
+/**
+ * Gets the status code in the HTTP response status line
+ */
+int get_status_code(const char* statusLine)
+{
+    int code = 0;
+    sscanf(statusLine, "%*s %d %*s", &code);
+    return code;
+}
+
 void *get_in_addr(struct sockaddr *sa)
 {
     if (sa->sa_family == AF_INET) {
@@ -64,34 +83,322 @@ int is_prefix(const char* pat, const char* str)
      }
  }
 
-int get_header_value(const char *headers, const char *field, char *buf, size_t sz)
+/**
+ * Returns the first byte in [p, end) equal to any of a, b, c or d, or end if
+ * there is none. Compares 32 or 16 bytes at a time when AVX2 or SSE2 is
+ * available. Pass the same byte more than once to look for fewer of them
+ */
+const char *scan_until(const char *p, const char *end, char a, char b, char c, char d)
+{
+#if defined(__AVX2__)
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    __m256i vc = _mm256_set1_epi8(c), vd = _mm256_set1_epi8(d);
+    __m256i v;
+    unsigned int mask;
+    for (; end - p >= 32; p += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i*)p);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vd))));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    __m128i vc = _mm_set1_epi8(c), vd = _mm_set1_epi8(d);
+    __m128i v;
+    unsigned int mask;
+    for (; end - p >= 16; p += 16)
+    {
+        v = _mm_loadu_si128((const __m128i*)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd))));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b || *p == c || *p == d) {
+            return p;
+        }
+    }
+    return end;
+}
+
+/**
+ * Returns the start of the first CRLFCRLF in [p, end), or NULL if there is none
+ */
+const char *find_header_end(const char *p, const char *end)
+{
+    while ((p = scan_until(p, end, '\r', '\r', '\r', '\r')) < end)
+    {
+        if (end - p >= 4 && p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * Records the name and value position of every field in the header, in a
+ * single sweep that stops only at colons and line ends. The last line does
+ * not need to end with CRLF. Returns the number of fields found
+ */
+int index_headers(const char *headers, size_t len, struct header_index *index)
+{
+    const char *p = headers, *end = headers + len;
+    const char *colon, *lineEnd, *value;
+    struct header_field *field;
+
+    index->count = 0;
+    while (p < end && index->count < MAX_HEADER_FIELDS)
+    {
+        colon = scan_until(p, end, ':', '\n', '\n', '\n');
+        if (colon == end) {
+            break;
+        }
+        if (*colon == '\n') {
+            // Not a field, e.g. the empty line ending the header
+            p = colon + 1;
+            continue;
+        }
+        lineEnd = scan_until(colon, end, '\n', '\n', '\n', '\n');
+
+        value = colon + 1;
+        while (value < lineEnd && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        field = &index->fields[index->count++];
+        field->name = p - headers;
+        field->nameLength = colon - p;
+        field->value = value - headers;
+        field->valueLength = lineEnd - value;
+        // Strip the CR and trailing whitespace
+        while (field->valueLength > 0 && (value[field->valueLength - 1] == '\r'
+                                          || value[field->valueLength - 1] == ' '
+                                          || value[field->valueLength - 1] == '\t'))
+        {
+            field->valueLength--;
+        }
+        p = lineEnd + 1;
+    }
+    return index->count;
+}
+
+/**
+ * Returns the position in the index of the first field with the given name,
+ * compared without case, or -1 if there is none
+ */
+int header_index_find(const struct header_index *index, const char *headers, const char *field)
 {
     size_t fieldLen = strlen(field);
+    int i;
+    for (i = 0; i < index->count; i++)
+    {
+        if ((size_t)index->fields[i].nameLength == fieldLen 
+            && strncasecmp(headers + index->fields[i].name, field, fieldLen) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Copies the value of the field into buf, truncated to sz - 1 bytes.
+ * Returns whether the field was found with a non-empty value
+ */
+int header_index_value(const struct header_index *index, const char *headers, 
+                       const char *field, char *buf, size_t sz)
+{
+    int i = header_index_find(index, headers, field);
     size_t bufLen;
-    char *fieldName = (char*)malloc(fieldLen + 2);
-    char *pch, *nextCRLF;
 
     if (sz <= 0) return 0;
 
-    strncpy(fieldName, field, fieldLen);
-    fieldName[fieldLen]     = ':';
-    fieldName[fieldLen + 1] = '\0';
+    buf[0] = '\0';
+    if (i >= 0)
+    {
+        bufLen = min(sz - 1, (size_t)index->fields[i].valueLength);
+        memcpy(buf, headers + index->fields[i].value, bufLen);
+        buf[bufLen] = '\0';
+    }
+    return buf[0] != '\0';
+}
+
+int get_header_value(const char *headers, const char *field, char *buf, size_t sz)
+{
+    struct header_index index;
+    index_headers(headers, strlen(headers), &index);
+    return header_index_value(&index, headers, field, buf, sz);
+}
+
+void ring_init(struct ring_buffer *ring, char *data, size_t size)
+{
+    ring->data = data;
+    ring->size = size;
+    ring->head = ring->tail = 0;
+}
+
+size_t ring_readable(const struct ring_buffer *ring)
+{
+    return ring->tail - ring->head;
+}
+
+/**
+ * Returns where the next bytes can be read, with the number of them that
+ * are contiguous in len
+ */
+char *ring_read_ptr(struct ring_buffer *ring, size_t *len)
+{
+    size_t offset = ring->head & (ring->size - 1);
+    *len = min(ring->tail - ring->head, ring->size - offset);
+    return ring->data + offset;
+}
+
+/**
+ * Returns where the next bytes can be written, with the number of free bytes
+ * that are contiguous in len
+ */
+char *ring_write_ptr(struct ring_buffer *ring, size_t *len)
+{
+    size_t offset = ring->tail & (ring->size - 1);
+    *len = min(ring->size - (ring->tail - ring->head), ring->size - offset);
+    return ring->data + offset;
+}
+
+void ring_consume(struct ring_buffer *ring, size_t len)
+{
+    ring->head += len;
+}
+
+void ring_produce(struct ring_buffer *ring, size_t len)
+{
+    ring->tail += len;
+}
+
+void arena_init(struct arena *a, size_t blockSize)
+{
+    a->head = NULL;
+    a->used = 0;
+    a->blockSize = blockSize;
+    a->spare = NULL;
+}
 
-    buf[0] = '\0';    
-    if ((pch = strstr(headers, fieldName)) != NULL)
+/**
+ * Returns size bytes aligned for any type, valid until the arena is reset.
+ * Allocations larger than the block size get a block of their own
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_block *block;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (a->head == NULL || a->used + size > a->head->size)
     {
-        pch += fieldLen + 1;
-        while (*pch == ' ' || *pch =='\t') {
-            pch++;
+        if (a->spare != NULL && size <= a->blockSize) {
+            block = a->spare;
+            a->spare = block->next;
+        }
+        else if ((block = (struct arena_block*)malloc(sizeof(struct arena_block)
+                                                      + max(size, a->blockSize))) == NULL) {
+            return NULL;
         }
-        nextCRLF = strstr(pch, CRLF);
-        bufLen = min(sz - 1, nextCRLF - pch) + 1;
-        strncpy(buf, pch, bufLen - 1);
-        buf[bufLen - 1] = '\0';
+        else {
+            block->size = max(size, a->blockSize);
+        }
+        block->next = a->head;
+        a->head = block;
+        a->used = 0;
     }
+    p = a->head->data + a->used;
+    a->used += size;
+    return p;
+}
 
-    free(fieldName);
-    return buf[0] != '\0';
+char *arena_strdup(struct arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = (char*)arena_alloc(a, len);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+/**
+ * Frees everything allocated from the arena at once. Up to
+ * ARENA_SPARE_BLOCKS blocks of the regular size are kept for the next
+ * allocations, which take them back in the order they were first filled
+ */
+void arena_reset(struct arena *a)
+{
+    struct arena_block *next, *spare;
+    int count = 0;
+
+    for (spare = a->spare; spare != NULL; spare = spare->next) {
+        count++;
+    }
+    // The head is the newest block, so pushing the chain reverses it
+    while (a->head != NULL)
+    {
+        next = a->head->next;
+        if (a->head->size > a->blockSize || count == ARENA_SPARE_BLOCKS) {
+            free(a->head);
+        }
+        else {
+            a->head->next = a->spare;
+            a->spare = a->head;
+            count++;
+        }
+        a->head = next;
+    }
+    a->used = 0;
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_block *next;
+
+    arena_reset(a);
+    while (a->spare != NULL)
+    {
+        next = a->spare->next;
+        free(a->spare);
+        a->spare = next;
+    }
+}
+
+/**
+ * Writes the time in the IMF-fixdate format of HTTP, like
+ * "Sun, 06 Nov 1994 08:49:37 GMT"
+ */
+void format_http_date(time_t t, char *buf, size_t sz)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, sz, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * Returns the time of an IMF-fixdate, or -1 if the date is malformed
+ */
+time_t parse_http_date(const char *date)
+{
+    struct tm tm;
+    const char *end;
+
+    memset(&tm, 0, sizeof tm);
+    if ((end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
 }
 
 void start_timer()
@@ -107,3 +414,86 @@ double end_timer()
     double diff_us = currentTime.tv_usec - savedTime.tv_usec;
     return diff_s * 1000 + diff_us / 1000;
 }
+
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int histogram_bucket(long long us)
+{
+    int shift;
+    if (us < 64) {
+        return us < 0 ? 0 : us;
+    }
+    // Keep the 6 most significant bits of the value
+    shift = 63 - __builtin_clzll(us) - 5;
+    if (shift > 32) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return shift * 32 + (us >> shift);
+}
+
+/**
+ * Largest value that falls in the bucket
+ */
+long long histogram_bucket_value(int bucket)
+{
+    int shift;
+    if (bucket < 64) {
+        return bucket;
+    }
+    shift = bucket / 32 - 1;
+    return ((long long)(bucket - shift * 32 + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, long long us)
+{
+    h->counts[histogram_bucket(us)]++;
+    h->total++;
+    h->sum += us;
+    if (us > h->max) {
+        h->max = us;
+    }
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+    int i;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    dst->max = max(dst->max, src->max);
+}
+
+/**
+ * Returns the value below which the given fraction (0 to 1) of the recorded
+ * values fall, to the precision of the buckets
+ */
+long long histogram_percentile(const struct histogram *h, double p)
+{
+    unsigned long long rank = (unsigned long long)(p * h->total + 0.5), seen = 0;
+    int i;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    rank = max(rank, 1);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if ((seen += h->counts[i]) >= rank) {
+            return min(histogram_bucket_value(i), h->max);
+        }
+    }
+    return h->max;
+}
@@ -2,12 +2,13 @@
 #define UTILS_H
 
 #include <netinet/in.h> 
+#include <time.h>
 
 #define HEADER_SIZE (1024 * 8)
-#define BODY_SIZE (10 * 1024 * 1024)
 #define REQUEST_LINE_SIZE (1024 * 4)
 #define STATUS_LINE_SIZE (1024 * 4)
 #define URI_SIZE (256)
+#define HTTP_DATE_SIZE 32
 
 #define CRLF "\r\n"
 #define CRLFCRLF "\r\n\r\n"
@@ -17,16 +18,108 @@
 #define min(a, b) ((a) < (b) ? a : b)
 #define max(a, b) ((a) > (b) ? a : b)
 
+#define MAX_HEADER_FIELDS 64
+
+/**
+ * Position of a header field, as offsets into the buffer holding the header
+ */
+struct header_field {
+    int name;
+    int nameLength;
+    int value;
+    int valueLength;
+};
+
+struct header_index {
+    int count;
+    struct header_field fields[MAX_HEADER_FIELDS];
+};
+
+
+/**
+ * Fixed-size byte queue. head and tail count the bytes ever read and written,
+ * size must be a power of two
+ */
+struct ring_buffer {
+    char *data;
+    size_t size;
+    size_t head;
+    size_t tail;
+};
+
+#define ARENA_SPARE_BLOCKS 4           // Blocks kept by a reset for the next allocations
+
+/**
+ * Bump-pointer allocator for memory that is all freed at once. Allocations
+ * come from a chain of blocks. Resetting it keeps up to ARENA_SPARE_BLOCKS
+ * blocks of the regular size, so memory can be reused without going back to
+ * malloc
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    char data[];
+};
+
+struct arena {
+    struct arena_block *head;   // Block being filled, older blocks after it
+    size_t used;                // Bytes taken from the head block
+    size_t blockSize;
+    struct arena_block *spare;  // Kept by the last reset, taken before malloc
+};
+
+// Log-linear histogram of microsecond values: exact below 64 us, then 32
+// buckets per power of two, which keeps the error under about 3%
+#define HISTOGRAM_BUCKETS (32 * 32 + 64)
+
+struct histogram {
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total;
+    long long sum;
+    long long max;
+};
 
 void *get_in_addr(struct sockaddr *sa);
 int is_prefix(const char *pat, const char *str);
 void parse_uri(const char *uri, char **host, char **path); 
+int get_status_code(const char *statusLine);
 int get_header_value(const char *headers, const char *field, char *buf, size_t sz);
 
+const char *scan_until(const char *p, const char *end, char a, char b, char c, char d);
+const char *find_header_end(const char *p, const char *end);
+int index_headers(const char *headers, size_t len, struct header_index *index);
+int header_index_find(const struct header_index *index, const char *headers, const char *field);
+int header_index_value(const struct header_index *index, const char *headers, 
+                       const char *field, char *buf, size_t sz);
+
+void ring_init(struct ring_buffer *ring, char *data, size_t size);
+size_t ring_readable(const struct ring_buffer *ring);
+char *ring_read_ptr(struct ring_buffer *ring, size_t *len);
+char *ring_write_ptr(struct ring_buffer *ring, size_t *len);
+void ring_consume(struct ring_buffer *ring, size_t len);
+void ring_produce(struct ring_buffer *ring, size_t len);
+
+void arena_init(struct arena *a, size_t blockSize);
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strdup(struct arena *a, const char *s);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+void format_http_date(time_t t, char *buf, size_t sz);
+time_t parse_http_date(const char *date);
+
 void print_buffer(const char* name, const char* buffer);
 
 void start_timer();
 double end_timer();
+long long now_ms();
+long long now_us();
+
+int histogram_bucket(long long us);
+long long histogram_bucket_value(int bucket);
+void histogram_record(struct histogram *h, long long us);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+long long histogram_percentile(const struct histogram *h, double p);
 
 #endif
 
@@ -0,0 +1,101 @@
+#include "work_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+/**
+ * Sets up an empty queue of at least size slots, rounded up to a power of
+ * two. Returns -1 if out of memory
+ */
+int work_queue_init(struct work_queue *q, size_t size)
+{
+    size_t i, n = 1;
+
+    while (n < size) {
+        n <<= 1;
+    }
+    if ((q->slots = (struct work_slot*)calloc(n, sizeof(struct work_slot))) == NULL) {
+        return -1;
+    }
+    // Slot i is ready for the item pushed at position i
+    for (i = 0; i < n; i++) {
+        q->slots[i].seq = i;
+    }
+    q->mask = n - 1;
+    q->head = q->tail = 0;
+    return sem_init(&q->items, 0, 0);
+}
+
+/**
+ * Adds the item at the back of the queue.
+ * Returns -1 without waiting if the queue is full
+ */
+int work_queue_push(struct work_queue *q, void *item)
+{
+    unsigned long long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct work_slot *slot;
+    long long diff;
+
+    while (1)
+    {
+        slot = &q->slots[pos & q->mask];
+        diff = (long long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            // The slot is free for this lap, claim it unless another producer did
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // Still holds the item of the previous lap
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&q->items);
+    return 0;
+}
+
+/**
+ * Takes the item at the front of a queue that is known to have one
+ */
+void *take_item(struct work_queue *q)
+{
+    unsigned long long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct work_slot *slot;
+    long long diff;
+    void *item;
+
+    while (1)
+    {
+        slot = &q->slots[pos & q->mask];
+        diff = (long long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0 && __atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (diff != 0) {
+            // Another consumer took it, or its producer is still filling it
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    item = slot->item;
+    // Free the slot for the next lap
+    __atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+/**
+ * Takes the item at the front of the queue, sleeping until there is one
+ */
+void *work_queue_pop(struct work_queue *q)
+{
+    while (sem_wait(&q->items) < 0 && errno == EINTR);
+    return take_item(q);
+}
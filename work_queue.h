@@ -0,0 +1,29 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stddef.h>
+#include <semaphore.h>
+
+struct work_slot {
+    unsigned long long seq;     // Which lap of the ring the slot is ready for
+    void *item;
+};
+
+/**
+ * Bounded multi-producer multi-consumer queue. Producers and consumers claim
+ * slots with a compare-and-swap on their own index and never wait for each
+ * other; a semaphore counting the items puts idle consumers to sleep
+ */
+struct work_queue {
+    struct work_slot *slots;
+    size_t mask;
+    unsigned long long head __attribute__((aligned(64)));   // Next slot to fill
+    unsigned long long tail __attribute__((aligned(64)));   // Next slot to empty
+    sem_t items;
+};
+
+int work_queue_init(struct work_queue *q, size_t size);
+int work_queue_push(struct work_queue *q, void *item);
+void *work_queue_pop(struct work_queue *q);
+
+#endif